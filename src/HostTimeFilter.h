@@ -0,0 +1,108 @@
+#pragma once
+
+#include <juce_core/juce_core.h>
+
+//==============================================================================
+// Maps the audio callback's running sample count to wall-clock time. The clock read
+// at the start of a callback includes however late the callback was woken, which
+// varies from block to block. A least-squares line through the last few hundred
+// readings against the sample count only follows the audio clock's real rate, so
+// timing from it doesn't pick up the callback jitter.
+class HostTimeFilter
+{
+public:
+    void prepare (double newSampleRate) noexcept
+    {
+        sampleRate = newSampleRate;
+        reset();
+    }
+
+    void reset() noexcept
+    {
+        numPoints = 0;
+        nextPoint = 0;
+    }
+
+    // Audio thread, once per block, with the clock read at the start of the block. Returns
+    // the filtered time of the block's first sample; the sample count then moves on by
+    // numSamples.
+    juce::int64 getBlockTimeMicros (juce::int64 nowMicros, int numSamples) noexcept
+    {
+        // The host stopped calling us for a while, or the device dropped out: start over
+        if (numPoints > 0 && std::abs (timeAt (sampleTime) - (double) (nowMicros - originMicros)) > maxErrorMicros)
+            reset();
+
+        if (numPoints == 0)
+        {
+            sampleTime = 0;
+            originMicros = nowMicros;
+        }
+
+        points[nextPoint] = { (double) sampleTime, (double) (nowMicros - originMicros) };
+        nextPoint = (nextPoint + 1) % maxPoints;
+        numPoints = juce::jmin (numPoints + 1, maxPoints);
+
+        fitLine();
+
+        const auto micros = originMicros + (juce::int64) std::llround (timeAt (sampleTime));
+        sampleTime += numSamples;
+        return micros;
+    }
+
+private:
+    static constexpr int maxPoints = 512;
+    static constexpr int minPointsForRate = 16;     // Until then the nominal rate is used
+    static constexpr double maxErrorMicros = 100000.0;
+
+    struct Point
+    {
+        double samples = 0.0;
+        double micros = 0.0;
+    };
+
+    Point points[maxPoints];
+    int numPoints = 0;
+    int nextPoint = 0;
+
+    double sampleRate = 44100.0;
+    juce::int64 sampleTime = 0;
+    juce::int64 originMicros = 0;
+    double meanSamples = 0.0;
+    double meanMicros = 0.0;
+    double microsPerSample = 0.0;
+
+    double timeAt (juce::int64 samples) const noexcept
+    {
+        return meanMicros + ((double) samples - meanSamples) * microsPerSample;
+    }
+
+    void fitLine() noexcept
+    {
+        meanSamples = 0.0;
+        meanMicros = 0.0;
+
+        for (int i = 0; i < numPoints; ++i)
+        {
+            meanSamples += points[i].samples;
+            meanMicros += points[i].micros;
+        }
+
+        meanSamples /= numPoints;
+        meanMicros /= numPoints;
+        microsPerSample = 1.0e6 / sampleRate;
+
+        if (numPoints < minPointsForRate)
+            return;
+
+        double covariance = 0.0, variance = 0.0;
+
+        for (int i = 0; i < numPoints; ++i)
+        {
+            covariance += (points[i].samples - meanSamples) * (points[i].micros - meanMicros);
+            variance += (points[i].samples - meanSamples) * (points[i].samples - meanSamples);
+        }
+
+        if (variance > 0.0)
+            microsPerSample = covariance / variance;
+    }
+};
@@ -24,7 +24,7 @@ JK_MidiClock::generateMidiclock(const AudioPlayHead::PositionInfo& positionInfo,
     //#########################################################################################
 
 
-    if (midiBuffer != nullptr)
+    if (midiBuffer != nullptr || outputFormat == umpOutput)
     {
         const double bpm = *positionInfo.getBpm();
 
@@ -33,139 +33,618 @@ JK_MidiClock::generateMidiclock(const AudioPlayHead::PositionInfo& positionInfo,
 
         const auto ppqPosition = *positionInfo.getPpqPosition();
 
+        const bool isPlaying = positionInfo.getIsPlaying() || positionInfo.getIsRecording();
+
         // PPQ offset to compensate Midi interface latency
-        double hostPpqPosition = ppqPosition + ppqOffset * ppqPerSample;
+        const double measuredPpqPosition = ppqPosition + ppqOffset * ppqPerSample;
+
+        // Run on the filtered position so host jitter doesn't look like a jump
+        positionHasJumped = updateTransportEstimate(measuredPpqPosition, isPlaying, bufferSize, sampleRate, ppqPerSample);
+
+        // Ticks are rendered from a straight line that only follows the estimate slowly,
+        // so jitter doesn't move the clock grid
+        double hostPpqPosition = renderPpqPosition;
+
+        outputBuffer = outputFormat == umpOutput ? nullptr : midiBuffer;
+
+        numUmpWords   = 0;
+        umpSampleRate = sampleRate;
+
+        // Tells the receiver where our timestamp clock is at the start of the block
+        if (outputFormat != midi1Output)
+        {
+            const uint32 jrClock = umpJrClock | getJrTime(blockStartSample);
+            writeUmpWords(&jrClock, 1);
+        }
+
+        // MMC locates are worked out relative to where the host says it is now
+        timecodeAnchorPpq     = ppqPosition;
+        timecodeAnchorSeconds = positionInfo.getTimeInSeconds().orFallback(ppqPosition * 60.0 / bpm);
+        timecodeSecondsPerPpq = 60.0 / bpm;
+        timecodeFrameRate     = positionInfo.getFrameRate().orFallback(AudioPlayHead::FrameRate().withBaseRate(30));
+
+        lookAheadSamples = roundToInt(lookAheadMs * sampleRate / 1000.0);
+
+#if JK_MIDICLOCK_CHECK_INVARIANTS
+        // Clock spacing is only defined within one steady run. A jump, stop, tempo or
+        // look-ahead change ends it: ticks already predicted are retimed, go out late or,
+        // when the look-ahead shrinks, leave a gap until the host catches up with them.
+        // None of those are checked; checking resumes once everything predicted up to
+        // now has been emitted.
+        if (positionHasJumped || !isPlaying)
+        {
+            steadyFromSample = blockStartSample + bufferSize + lookAheadSamples;
+        }
+        else if (bpm != expectedTickBpm || lookAheadSamples != expectedLookAheadSamples)
+        {
+            const int64 predictedUntilSample = blockStartSample + roundToInt64((predictedUntilPpq - hostPpqPosition) / ppqPerSample);
+
+            steadyFromSample = jmax(blockStartSample + bufferSize + lookAheadSamples, predictedUntilSample);
+        }
+
+        expectedTickSpacing      = roundToInt((60.0 * sampleRate) / (bpm * 24.0));
+        expectedTickBpm          = bpm;
+        expectedLookAheadSamples = lookAheadSamples;
+#endif
+
+        // Keep scheduling until anything still pending has been emitted
+        schedulingAhead = lookAheadSamples > 0 || pendingCount > 0;
 
-        if (positionInfo.getIsPlaying() || positionInfo.getIsRecording())
+        if (schedulingAhead)
+        {
+            scheduleAhead(positionInfo, hostPpqPosition, bufferSize, sampleRate, bpm);
+        }
+        else
+        {
+            windowStartSample = blockStartSample;
+
+            renderWindow(positionInfo, hostPpqPosition, bufferSize, sampleRate, bpm);
+
+            // Where predictions pick up if a look-ahead is set while playing
+            predictedUntilPpq         = hostPpqPosition + bufferSize * ppqPerSample;
+            predictedBpm              = bpm;
+            predictedLookAheadSamples = 0;
+        }
+
+        blockStartSample += bufferSize;
+    }
+}
+
+void
+JK_MidiClock::renderWindow(const AudioPlayHead::PositionInfo& positionInfo, double hostPpqPosition, int numSamples, double sampleRate, double bpm)
+{
+    // Runs the transport state machine over numSamples starting at hostPpqPosition.
+    // Without look-ahead the window is the current block.
+    const double ppqPerSample = (bpm / 60.0) / sampleRate;
+
+    windowStartPpq     = hostPpqPosition;
+    windowPpqPerSample = ppqPerSample;
+
+    if (positionInfo.getIsPlaying() || positionInfo.getIsRecording())
+    {
+        if (!wasPlaying)
         {
-            if (!wasPlaying)
+            // set the point where to start the slave
+            ppqToStartSyncAt = getNearestSixteenthInPPQ(hostPpqPosition);
+
+            // Special case: Master is set to always start playback from the previous start position...
+            if (positionHasJumped)
+            {
+                // Cue Midiclock slave to the nearest sixteenth note to new start position
+                // because the one calculated in stop mode isn't valid anymore.
+                sendSongPositionPointerMessage(ppqToStartSyncAt, 0);
+            }
+        }
+        else
+        {
+            // Position jump (loop or manually position change while playing)
+            if (positionHasJumped)
             {
                 // set the point where to start the slave
                 ppqToStartSyncAt = getNearestSixteenthInPPQ(hostPpqPosition);
 
-                // Special case: Master is set to always start playback from the previous start position...
-                if (positionJumped(syncPpqPosition, hostPpqPosition, sampleRate, ppqPerSample))
-                {
-                    // Cue Midiclock slave to the nearest sixteenth note to new start position
-                    // because the one calculated in stop mode isn't valid anymore.
-                    sendSongPositionPointerMessage(ppqToStartSyncAt, 0, midiBuffer);
-                }
-            }
-            else
-            {
-                // Position jump (loop or manually position change while playing)
-                if (positionJumped(syncPpqPosition, hostPpqPosition, sampleRate, ppqPerSample))
+                // User has changed position manually while playing
+                if (syncFlag == 0)
                 {
-                    // set the point where to start the slave
-                    ppqToStartSyncAt = getNearestSixteenthInPPQ(hostPpqPosition);
+                    stopMessage.setTimeStamp(0);
 
-                    // User has changed position manually while playing
-                    if (syncFlag == 0)
-                    {
-                        stopMessage.setTimeStamp(0);
+                    addEvent(stopMessage, 0);
+                    sendMmcCommand(mmcStop, 0);
 
-                        midiBuffer->addEvent(stopMessage, 0);
+                    sendSongPositionPointerMessage(hostPpqPosition, 0);
 
-                        sendSongPositionPointerMessage(hostPpqPosition, 0, midiBuffer);
+                    syncFlag = gStartSlave;
+                }
+                else
+                {
+                    // A slave still waiting to be started is cued to the new position either way
+                    if (followSongPosition || (syncFlag & gStartSlave) == gStartSlave)
+                    {
+                        sendSongPositionPointerMessage(hostPpqPosition, 0);
 
                         syncFlag = gStartSlave;
                     }
                     else
-                    {
-                        if (followSongPosition)
-                        {
-                            sendSongPositionPointerMessage(hostPpqPosition, 0, midiBuffer);
-
-                            syncFlag = gStartSlave;
-                        }
-                        else
-                            syncFlag = 0;
-                    }
+                        syncFlag = 0;
                 }
             }
+        }
 
-            for (int posInBuffer = 0; posInBuffer < bufferSize; ++posInBuffer)
-            {
-                syncPpqPosition = hostPpqPosition + (posInBuffer * ppqPerSample);
+        // Clocks fall on every 24th of a quarter note. Working in PPQ rather than song
+        // samples keeps the grid in place across tempo changes, and the last clock sent is
+        // remembered across windows, so a start position nudged by a sample between blocks
+        // neither skips a clock nor sends one twice.
+        if (!wasPlaying || positionHasJumped)
+            lastClockIndex = static_cast<int64>(ceil(hostPpqPosition * 24.0)) - 1;
+
+        for (int posInBuffer = 0; posInBuffer < numSamples; ++posInBuffer)
+        {
+            syncPpqPosition = hostPpqPosition + (posInBuffer * ppqPerSample);
 
-                const int   clockDistanceInSamples = roundToInt((60.0 * sampleRate) / (bpm * 24.0));
-                const int64 hostSamplePos          = roundToInt64((hostPpqPosition * (60.0 / bpm)) * sampleRate);
-                const int64 syncSamplePos          = hostSamplePos + posInBuffer;
+            const int clockDistanceInSamples = roundToInt((60.0 * sampleRate) / (bpm * 24.0));
 
-                // Some hosts like Cubase come up with a wacky ppqPosition
-                // that could break the timing! Best is to "wait"
-                // here for the right ppqPosition to jump on.
-                if (syncPpqPosition >= ppqToStartSyncAt)
+            // Some hosts like Cubase come up with a wacky ppqPosition
+            // that could break the timing! Best is to "wait"
+            // here for the right ppqPosition to jump on.
+            if (syncPpqPosition >= ppqToStartSyncAt)
+            {
+                if ((syncFlag & gStartSlave) == gStartSlave)
                 {
-                    if ((syncFlag & gStartSlave) == gStartSlave)
-                    {
-                        continueMessage.setTimeStamp(static_cast<double>(posInBuffer));
+                    continueMessage.setTimeStamp(static_cast<double>(posInBuffer));
 
-                        midiBuffer->addEvent(continueMessage, posInBuffer);
+                    addEvent(continueMessage, posInBuffer);
+                    sendMmcCommand(mmcPlay, posInBuffer);
 
-                        syncFlag &= gCycleEnd;
-                    }
+                    syncFlag &= gCycleEnd;
+                }
 
-                    // Loop mode on
-                    auto loopPoints = *positionInfo.getLoopPoints();
-                    if (positionInfo.getIsLooping() && loopPoints.ppqStart != loopPoints.ppqEnd)
-                    {
-                        const double ppqToCycleEnd     = fabs(loopPoints.ppqEnd - syncPpqPosition);
-                        const int64  samplesToCycleEnd = roundToInt64(ppqToCycleEnd * (60.0 / bpm) * sampleRate);
+                // Loop mode on
+                auto loopPoints = *positionInfo.getLoopPoints();
+                if (positionInfo.getIsLooping() && loopPoints.ppqStart != loopPoints.ppqEnd)
+                {
+                    const double ppqToCycleEnd     = fabs(loopPoints.ppqEnd - syncPpqPosition);
+                    const int64  samplesToCycleEnd = roundToInt64(ppqToCycleEnd * (60.0 / bpm) * sampleRate);
 
-                        if ((syncFlag & gCycleEnd) == 0)
+                    if ((syncFlag & gCycleEnd) == 0)
+                    {
+                        if (samplesToCycleEnd <= clockDistanceInSamples)  // For fine tuning tweak here
                         {
-                            if (samplesToCycleEnd <= clockDistanceInSamples)  // For fine tuning tweak here
+                            // We have reached the loop- end position
+                            // and must stop the Midiclock slave here
+                            if (followSongPosition)
                             {
-                                // We have reached the loop- end position
-                                // and must stop the Midiclock slave here
-                                if (followSongPosition)
-                                {
-                                    stopMessage.setTimeStamp(static_cast<double>(posInBuffer));
-
-                                    midiBuffer->addEvent(stopMessage, posInBuffer);
-                                }
+                                stopMessage.setTimeStamp(static_cast<double>(posInBuffer));
 
-                                syncFlag |= gCycleEnd;
+                                addEvent(stopMessage, posInBuffer);
+                                sendMmcCommand(mmcStop, posInBuffer);
                             }
+
+                            syncFlag |= gCycleEnd;
                         }
                     }
                 }
+            }
 
-                // For best timing we should never interupt Midiclock messages!
-                // Seems that some slaves constantly adjusting their internal clock
-                // to Midiclock even if they are in stop mode.
-                if (syncSamplePos % clockDistanceInSamples == 0)
-                {
-                    clockMessage.setTimeStamp(static_cast<double>(posInBuffer));
+            // For best timing we should never interupt Midiclock messages!
+            // Seems that some slaves constantly adjusting their internal clock
+            // to Midiclock even if they are in stop mode.
+            if (syncPpqPosition * 24.0 >= static_cast<double>(lastClockIndex + 1))
+            {
+                lastClockIndex = static_cast<int64>(floor(syncPpqPosition * 24.0));
 
-                    midiBuffer->addEvent(clockMessage, posInBuffer);
-                }
+                clockMessage.setTimeStamp(static_cast<double>(posInBuffer));
+
+                addEvent(clockMessage, posInBuffer);
             }
+        }
+
+        wasPlaying = true;
+    }
+    else
+    {
+        // Send positioning message if the user has stopped or if he changed the playhead position
+        // manually in stop mode! This will also initially cue slave after loading plugin instance.
+        if (wasPlaying || positionHasJumped)
+        {
+            stopMessage.setTimeStamp(0);
+
+            addEvent(stopMessage, 0);
+            sendMmcCommand(mmcStop, 0);
 
-            wasPlaying = true;
+            sendSongPositionPointerMessage(hostPpqPosition, 0);
         }
-        else
+
+        syncPpqPosition = hostPpqPosition;
+
+        syncFlag = gStartSlave;
+
+        wasPlaying = false;
+    }
+}
+
+void
+JK_MidiClock::scheduleAhead(const AudioPlayHead::PositionInfo& positionInfo, double hostPpqPosition, int bufferSize, double sampleRate, double bpm)
+{
+    const double ppqPerSample = (bpm / 60.0) / sampleRate;
+    const bool   isPlaying    = positionInfo.getIsPlaying() || positionInfo.getIsRecording();
+
+    // Predicted events are only valid while the transport keeps running where we expected.
+    // A stop or a position jump throws them away; the state machine then sees the jump
+    // and cues the slave from the real position.
+    if (!isPlaying || !wasPlaying || positionHasJumped)
+    {
+        cancelPendingEvents();
+
+        predictedUntilPpq = hostPpqPosition + lookAheadSamples * ppqPerSample;
+    }
+    else if (bpm != predictedBpm || lookAheadSamples != predictedLookAheadSamples)
+    {
+        // Same musical positions, new tempo or lead
+        retimePendingEvents(hostPpqPosition, ppqPerSample);
+    }
+
+    // Extend the prediction to lookAhead past the end of this block
+    const int64 windowEndSample = blockStartSample + bufferSize + lookAheadSamples;
+    windowStartSample           = blockStartSample + roundToInt64((predictedUntilPpq - hostPpqPosition) / ppqPerSample);
+
+    // Start the window on an output sample, so event times are only rounded once
+    predictedUntilPpq = hostPpqPosition + static_cast<double>(windowStartSample - blockStartSample) * ppqPerSample;
+
+    const int numSamples = static_cast<int>(windowEndSample - windowStartSample);
+
+    if (numSamples > 0)
+    {
+        renderWindow(positionInfo, predictedUntilPpq, numSamples, sampleRate, bpm);
+
+        predictedUntilPpq += numSamples * ppqPerSample;
+    }
+
+    predictedBpm              = bpm;
+    predictedLookAheadSamples = lookAheadSamples;
+
+    // Emit everything that falls due in this block. Retiming keeps the ring in dueSample
+    // order, so only its head needs checking. Events that became late (the tempo went up
+    // or look-ahead was increased) go out at the start of the block.
+    while (pendingCount > 0 && pendingEvents[pendingRead].dueSample < blockStartSample + bufferSize)
+    {
+        const PendingEvent& event       = pendingEvents[pendingRead];
+        const int           posInBuffer = static_cast<int>(jmax((int64)0, event.dueSample - blockStartSample));
+
+        emitEvent(event.data, event.numBytes, posInBuffer);
+
+        pendingRead = (pendingRead + 1) % pendingCapacity;
+        --pendingCount;
+    }
+}
+
+void
+JK_MidiClock::addEvent(const MidiMessage& message, int posInWindow)
+{
+    addEvent(message.getRawData(), message.getRawDataSize(), posInWindow);
+}
+
+void
+JK_MidiClock::addEvent(const uint8* data, int numBytes, int posInWindow)
+{
+    if (!schedulingAhead)
+    {
+        emitEvent(data, numBytes, posInWindow);
+        return;
+    }
+
+    // The ring is sized for maxLookAheadMs at any sane tempo; never allocate here
+    if (pendingCount == pendingCapacity)
+    {
+        jassertfalse;
+        return;
+    }
+
+    PendingEvent& event = pendingEvents[(pendingRead + pendingCount) % pendingCapacity];
+
+    event.dueSample   = windowStartSample + posInWindow - lookAheadSamples;
+    event.ppqPosition = windowStartPpq + posInWindow * windowPpqPerSample;
+    event.numBytes    = jmin(numBytes, static_cast<int>(sizeof(event.data)));
+
+    memcpy(event.data, data, static_cast<size_t>(event.numBytes));
+
+    ++pendingCount;
+}
+
+void
+JK_MidiClock::retimePendingEvents(double hostPpqPosition, double ppqPerSample)
+{
+    for (int i = 0; i < pendingCount; ++i)
+    {
+        PendingEvent& event = pendingEvents[(pendingRead + i) % pendingCapacity];
+
+        event.dueSample = blockStartSample + roundToInt64((event.ppqPosition - hostPpqPosition) / ppqPerSample) - lookAheadSamples;
+    }
+}
+
+void
+JK_MidiClock::cancelPendingEvents()
+{
+    // Ticks, continues, song positions and locates predicted from the old position are
+    // dropped. Predicted stops still go out at the start of the block: stopping the
+    // slave early is harmless, starting it from the wrong position is not.
+    for (int i = 0; i < pendingCount; ++i)
+    {
+        const PendingEvent& event = pendingEvents[(pendingRead + i) % pendingCapacity];
+
+        const bool isStop    = event.data[0] == 0xfc;
+        const bool isMmcStop = event.data[0] == 0xf0 && event.numBytes == sizeof(mmcCommandTemplate) && event.data[4] == mmcStop;
+
+        if (isStop || isMmcStop)
+            emitEvent(event.data, event.numBytes, 0);
+    }
+
+    pendingRead  = 0;
+    pendingCount = 0;
+
+    // The state machine ran ahead on the prediction. If the slave hasn't really been
+    // started, roll it back so it is cued and started again from the new position.
+    if (!slaveIsRunning)
+        syncFlag |= gStartSlave;
+}
+
+void
+JK_MidiClock::emitEvent(const uint8* data, int numBytes, int posInBuffer)
+{
+#if JK_MIDICLOCK_CHECK_INVARIANTS
+    checkInvariants(data, blockStartSample + posInBuffer);
+#endif
+
+    // What the slave has really been sent, as opposed to what the state machine predicted
+    if (data[0] == 0xfa || data[0] == 0xfb)
+        slaveIsRunning = true;
+    else if (data[0] == 0xfc)
+        slaveIsRunning = false;
+
+    if (outputBuffer != nullptr)
+        outputBuffer->addEvent(data, numBytes, posInBuffer);
+
+    if (outputFormat != midi1Output)
+        writeUmp(data, numBytes, blockStartSample + posInBuffer);
+}
+
+void
+JK_MidiClock::writeUmp(const uint8* data, int numBytes, int64 samplePosition)
+{
+    // Every event carries its own JR timestamp, so it keeps sample accurate timing
+    // however the receiver delivers the block
+    uint32 words[4];
+    words[0] = umpJrTimestamp | getJrTime(samplePosition);
+
+    if (data[0] == 0xf8)
+    {
+        words[1] = umpClockPacket;
+        writeUmpWords(words, 2);
+    }
+    else if (data[0] != 0xf0)
+    {
+        // System real time and common: status plus up to two data bytes
+        words[1] = umpSystemHeader | (static_cast<uint32>(data[0]) << 16);
+
+        if (numBytes > 1)
+            words[1] |= static_cast<uint32>(data[1]) << 8;
+        if (numBytes > 2)
+            words[1] |= static_cast<uint32>(data[2]);
+
+        writeUmpWords(words, 2);
+    }
+    else
+    {
+        // SysEx7 without F0/F7, six bytes per packet: complete, or start/continue/end
+        const uint8* payload     = data + 1;
+        int          payloadSize = numBytes - (data[numBytes - 1] == 0xf7 ? 2 : 1);
+        bool         first       = true;
+
+        writeUmpWords(words, 1);
+
+        do
         {
-            // Send positioning message if the user has stopped or if he changed the playhead position
-            // manually in stop mode! This will also initially cue slave after loading plugin instance.
-            if (wasPlaying || positionJumped(syncPpqPosition, hostPpqPosition, sampleRate, ppqPerSample))
-            {
-                stopMessage.setTimeStamp(0);
+            const int    chunk  = jmin(payloadSize, 6);
+            const bool   last   = chunk == payloadSize;
+            const uint32 status = first ? (last ? 0x0 : 0x1) : (last ? 0x3 : 0x2);
+            uint8        bytes[6]{};
+
+            memcpy(bytes, payload, static_cast<size_t>(chunk));
+
+            words[0] = umpSysExHeader | (status << 20) | (static_cast<uint32>(chunk) << 16)
+                     | (static_cast<uint32>(bytes[0]) << 8) | bytes[1];
+            words[1] = (static_cast<uint32>(bytes[2]) << 24) | (static_cast<uint32>(bytes[3]) << 16)
+                     | (static_cast<uint32>(bytes[4]) << 8) | bytes[5];
+
+            writeUmpWords(words, 2);
+
+            payload     += chunk;
+            payloadSize -= chunk;
+            first        = false;
+        }
+        while (payloadSize > 0);
+    }
+}
+
+void
+JK_MidiClock::writeUmpWords(const uint32* words, int count)
+{
+    // Sized for a long block at high tempo with MMC on; never allocate here
+    if (numUmpWords + count > umpCapacity)
+    {
+        jassertfalse;
+        return;
+    }
 
-                midiBuffer->addEvent(stopMessage, 0);
+    memcpy(umpWords + numUmpWords, words, static_cast<size_t>(count) * sizeof(uint32));
+    numUmpWords += count;
+}
 
-                sendSongPositionPointerMessage(hostPpqPosition, 0, midiBuffer);
+uint32
+JK_MidiClock::getJrTime(int64 samplePosition)
+{
+    // 16 bit, wraps every ~2 s, which is all a receiver needs to place events
+    return static_cast<uint32>(roundToInt64(static_cast<double>(samplePosition) * jrTicksPerSecond / umpSampleRate)) & 0xffff;
+}
+
+#if JK_MIDICLOCK_CHECK_INVARIANTS
+void
+JK_MidiClock::checkInvariants(const uint8* data, int64 samplePosition)
+{
+    switch (data[0])
+    {
+        case 0xfa:  // Start
+        case 0xfb:  // Continue
+            if (slaveIsRunning)
+            {
+                ++invariantViolations.doubleContinue;
+                jassertfalse;
             }
+            break;
 
-            syncPpqPosition = hostPpqPosition;
+        case 0xf2:  // Song position pointer
+            if (slaveIsRunning)
+            {
+                ++invariantViolations.sppWhileRunning;
+                jassertfalse;
+            }
+            break;
 
-            syncFlag = gStartSlave;
+        case 0xf8:  // Clock, may legitimately jitter with the host position
+            if (lastTickSample >= steadyFromSample && std::abs((samplePosition - lastTickSample) - expectedTickSpacing) > tickSpacingTolerance)
+                ++invariantViolations.tickSpacing;
 
-            wasPlaying = false;
-        }
+            lastTickSample = samplePosition;
+            break;
+
+        default:
+            break;
     }
 }
+#endif
+
+bool
+JK_MidiClock::updateTransportEstimate(double measuredPpqPosition, bool isPlaying, int bufferSize, double sampleRate, double ppqPerSample)
+{
+    // Alpha-beta filter over host PPQ against sample time. Deviations from the prediction
+    // within the host's measured jitter are smoothed out. Large ones (locates, loop wraps)
+    // are jumps right away, and anything in between must stay about the same distance off
+    // for jumpConfirmBlocks blocks before it counts, so erratic ppqPositions don't restart
+    // the slave. Residuals are in seconds, so the measured jitter carries over tempo changes.
+    const double predictedPpqPosition = estimatedPpqPosition + estimatedPpqPerSample * lastBlockSize;
+    const double predictedRenderPpq   = renderPpqPosition + estimatorPpqPerSample * lastBlockSize;
+    const double residual             = measuredPpqPosition - predictedPpqPosition;
+    const double residualSeconds      = residual / (sampleRate * ppqPerSample);
+    const double jitterBand           = jmax(posChangeThreshold, jitterDeviations * std::sqrt(holdingJump ? heldJitterVariance : jitterVariance));
+    const bool   warmingUp            = numJitterSamples < jitterWarmUpBlocks;
+    const double jumpSeconds          = warmingUp ? 2.0 * jitterTolerance : jmax(jitterTolerance, 2.0 * jitterBand);
+    const bool   measuringJitter      = isPlaying && estimatorWasPlaying;
+
+    bool jumped = false;
+
+    if (!estimatorIsValid)
+    {
+        jumped = true;
+    }
+    else if (!isPlaying)
+    {
+        // No jitter to expect in stop mode, every move there is a locate
+        jumped = positionJumped(predictedPpqPosition, measuredPpqPosition, sampleRate, ppqPerSample);
+
+        if (!jumped)
+            estimatedPpqPosition = predictedPpqPosition + estimatorAlpha * residual;
+    }
+    else if (fabs(residualSeconds) >= jumpSeconds)
+    {
+        jumped = true;
+    }
+    else if (fabs(residualSeconds) <= jitterBand || warmingUp)
+    {
+        // Until a few residuals are in, the jitter band isn't known yet
+        estimatedPpqPosition = predictedPpqPosition + estimatorAlpha * residual;
+
+        if (estimatorWasPlaying && lastBlockSize > 0)
+            estimatedPpqPerSample += estimatorBeta * residual / lastBlockSize;
+
+        holdingJump = false;
+    }
+    else if (holdingJump && fabs(residualSeconds - heldResidualSeconds) <= jitterBand)
+    {
+        // The host has stayed at the new position so far
+        jumped = ++heldBlocks >= jumpConfirmBlocks;
+
+        if (jumped)
+            jitterVariance = heldJitterVariance;  // The held residuals weren't jitter
+        else
+            estimatedPpqPosition = predictedPpqPosition;
+    }
+    else
+    {
+        // Coast on the prediction for now
+        if (!holdingJump)
+            heldJitterVariance = jitterVariance;
+
+        holdingJump          = true;
+        heldResidualSeconds  = residualSeconds;
+        heldBlocks           = 1;
+        estimatedPpqPosition = predictedPpqPosition;
+    }
+
+    if (measuringJitter && !jumped)
+    {
+        // Running mean at first, then an exponential one
+        const double weight = jmax(jitterVarianceAlpha, 1.0 / (numJitterSamples + 1));
+
+        jitterVariance += weight * (residualSeconds * residualSeconds - jitterVariance);
+        numJitterSamples = jmin(numJitterSamples + 1, static_cast<int>(1.0 / jitterVarianceAlpha));
+    }
+
+    const bool tempoChanged = isPlaying && estimatorWasPlaying && ppqPerSample != estimatorPpqPerSample;
+
+    if (jumped || tempoChanged)
+    {
+        // A tempo change starts a new run anyway, so take the host's word for it
+        estimatedPpqPosition  = measuredPpqPosition;
+        estimatedPpqPerSample = ppqPerSample;
+        estimatorIsValid      = true;
+        holdingJump           = false;
+    }
+
+    // The rendered position carries on at the host's nominal tempo and is pulled towards
+    // the estimate by at most renderMaxCorrection samples per clock interval, so the clock
+    // spacing never moves by more than that. A block holding several clocks only gets one
+    // interval's worth, as it all lands on the clock that straddles the block boundary.
+    // The residual and the rate term, which are noisy on short blocks, only feed the jump
+    // decisions above.
+    if (jumped || !isPlaying || !estimatorWasPlaying)
+    {
+        renderPpqPosition = estimatedPpqPosition;
+    }
+    else if (tempoChanged)
+    {
+        // The position carries on through a tempo change, rather than snapping to a
+        // jittered host value. Only the offset moves, as it's in samples.
+        renderPpqPosition = predictedRenderPpq + ppqOffset * (ppqPerSample - estimatorPpqPerSample);
+    }
+    else
+    {
+        const double clocksInBlock = lastBlockSize * ppqPerSample * 24.0;
+        const double maxCorrection = renderMaxCorrection * ppqPerSample * jmin(1.0, clocksInBlock);
+
+        renderPpqPosition = predictedRenderPpq + jlimit(-maxCorrection, maxCorrection, renderAlpha * (estimatedPpqPosition - predictedRenderPpq));
+    }
+
+    // The rate term only tracks small drift around the tempo the host reports
+    if (!isPlaying)
+        estimatedPpqPerSample = 0.0;
+    else if (!estimatorWasPlaying || ppqPerSample != estimatorPpqPerSample)
+        estimatedPpqPerSample = ppqPerSample;
+
+    estimatorPpqPerSample = ppqPerSample;
+    estimatorWasPlaying   = isPlaying;
+    lastBlockSize         = bufferSize;
+
+    return jumped;
+}
 
 bool
 JK_MidiClock::positionJumped(double lastPosInPPQ, double currentPosInPPQ, double sampleRate, double ppqPerSample)
@@ -180,14 +659,88 @@ JK_MidiClock::positionJumped(double lastPosInPPQ, double currentPosInPPQ, double
 }
 
 void
-JK_MidiClock::sendSongPositionPointerMessage(double ppqPosition, int posInBuffer, MidiBuffer* buffer)
+JK_MidiClock::sendSongPositionPointerMessage(double ppqPosition, int posInWindow)
 {
     // This will cue the slave to the NEAREST
     // 16th note to the given ppqPosition.
     const int intBeat = static_cast<int>(ceil(ppqPosition * 4));
 
     MidiMessage songPositionMessage(MidiMessage::songPositionPointer(intBeat));
-    songPositionMessage.setTimeStamp(static_cast<double>(posInBuffer));
+    songPositionMessage.setTimeStamp(static_cast<double>(posInWindow));
+
+    addEvent(songPositionMessage, posInWindow);
+
+    sendMmcLocate(intBeat / 4.0, posInWindow);
+}
+
+void
+JK_MidiClock::sendMmcCommand(uint8 command, int posInWindow)
+{
+    if (!mmcEnabled)
+        return;
+
+    mmcCommandTemplate[4] = command;
+
+    for (int i = 0; i < numMmcDeviceIds; ++i)
+    {
+        mmcCommandTemplate[2] = mmcDeviceIds[i];
+
+        addEvent(mmcCommandTemplate, sizeof(mmcCommandTemplate), posInWindow);
+    }
+}
 
-    buffer->addEvent(songPositionMessage, posInBuffer);
+void
+JK_MidiClock::sendMmcLocate(double ppqPosition, int posInWindow)
+{
+    if (!mmcEnabled)
+        return;
+
+    const double seconds = jmax(0.0, timecodeAnchorSeconds + (ppqPosition - timecodeAnchorPpq) * timecodeSecondsPerPpq);
+
+    // MMC only knows 24, 25, 29.97 drop and 30 fps (bits 5-6 of the hours byte)
+    const bool drop       = timecodeFrameRate.isDrop();
+    const int  sourceBase = jmax(1, timecodeFrameRate.getBaseRate());
+    int        baseRate   = sourceBase;
+    uint8      rateType   = 3;
+
+    if (baseRate == 24)
+        rateType = 0;
+    else if (baseRate == 25)
+        rateType = 1;
+    else
+    {
+        baseRate = 30;
+        rateType = drop ? 2 : 3;
+    }
+
+    // Frames are counted at the real rate, so 23.976 and 29.97 non-drop run slower than
+    // their nominal rate. Other rates are sent as 30 fps, keeping their pull-down.
+    const double frameRate   = timecodeFrameRate.getEffectiveRate() * baseRate / sourceBase;
+    const double framesExact = seconds * frameRate;
+    int64        frames      = static_cast<int64>(framesExact);
+    const int    subFrames   = static_cast<int>((framesExact - static_cast<double>(frames)) * 100.0);
+
+    if (drop)
+    {
+        // Skip frame numbers 0 and 1 of every minute except each tenth one
+        const int64 tenMinutes = frames / 17982;
+        const int64 remainder  = frames % 17982;
+
+        frames += 18 * tenMinutes + (remainder > 1 ? 2 * ((remainder - 2) / 1798) : 0);
+    }
+
+    const int64 totalSeconds = frames / baseRate;
+
+    mmcLocateTemplate[7]  = static_cast<uint8>((rateType << 5) | ((totalSeconds / 3600) % 24));
+    mmcLocateTemplate[8]  = static_cast<uint8>((totalSeconds / 60) % 60);
+    mmcLocateTemplate[9]  = static_cast<uint8>(totalSeconds % 60);
+    mmcLocateTemplate[10] = static_cast<uint8>(frames % baseRate);
+    mmcLocateTemplate[11] = static_cast<uint8>(subFrames);
+
+    for (int i = 0; i < numMmcDeviceIds; ++i)
+    {
+        mmcLocateTemplate[2] = mmcDeviceIds[i];
+
+        addEvent(mmcLocateTemplate, sizeof(mmcLocateTemplate), posInWindow);
+    }
 }
@@ -18,6 +18,12 @@
 #include <juce_core/juce_core.h>
 #include <juce_audio_basics/juce_audio_basics.h>
 
+// Builds the transport invariant checks into the engine, for the stress test. They
+// cost a branch per event and assert on violations, so they're off in the plugin.
+#ifndef JK_MIDICLOCK_CHECK_INVARIANTS
+ #define JK_MIDICLOCK_CHECK_INVARIANTS 0
+#endif
+
 using namespace juce;
 
 class JK_MidiClock
@@ -53,6 +59,129 @@ class JK_MidiClock
     {
         return ppqOffset;
     }
+    // Host position changes below this are treated as jitter unless they persist
+    // for a few blocks; anything larger is a jump. A host measured to jitter more
+    // than this gets a correspondingly wider tolerance.
+    void
+    setJitterTolerance(double ms)
+    {
+        jitterTolerance = ms / 1000.0;
+    }
+    double
+    getJitterTolerance()
+    {
+        return jitterTolerance * 1000.0;
+    }
+    // Also sends MIDI Machine Control play/stop/locate for recorders and video
+    // players that don't follow clock. Each command goes to every device ID
+    // set here (default 0x7F, all-call).
+    void
+    setMmcEnabled(bool shouldSend)
+    {
+        mmcEnabled = shouldSend;
+    }
+    bool
+    getMmcEnabled()
+    {
+        return mmcEnabled;
+    }
+    void
+    clearMmcDeviceIds()
+    {
+        numMmcDeviceIds = 0;
+    }
+    void
+    addMmcDeviceId(int deviceId)
+    {
+        if (numMmcDeviceIds < maxMmcDeviceIds)
+            mmcDeviceIds[numMmcDeviceIds++] = static_cast<uint8>(deviceId & 0x7f);
+    }
+    // Emits clock and transport messages this many ms ahead of their musical position.
+    // Unlike setOffset() this may be larger than a block: ticks are predicted ahead and
+    // held back until their block comes up. One instance serves one destination.
+    void
+    setLookAhead(double ms)
+    {
+        lookAheadMs = jlimit(0.0, maxLookAheadMs, ms);
+    }
+    double
+    getLookAhead()
+    {
+        return lookAheadMs;
+    }
+
+    // Forgets what the slave has been sent, e.g. after another clock source drove it.
+    // The next block cues and starts it from the host position as after loading.
+    void
+    resetTransport()
+    {
+        wasPlaying       = false;
+        syncFlag         = gStartSlave;
+        slaveIsRunning   = false;
+        pendingRead      = 0;
+        pendingCount     = 0;
+        estimatorIsValid = false;
+    }
+
+    // Transport invariants, checked on every event leaving the engine so it can be
+    // driven with random playhead sequences outside a plugin host. Always zero unless
+    // built with JK_MIDICLOCK_CHECK_INVARIANTS. Tick spacing is only checked within a
+    // steady run, see generateMidiclock().
+    struct InvariantViolations
+    {
+        int64 doubleContinue  = 0;  // Continue while the slave is already running
+        int64 sppWhileRunning = 0;  // Song position pointer without a stop first
+        int64 tickSpacing     = 0;  // Clock interval off by more than the tolerance
+    };
+    InvariantViolations
+    getInvariantViolations()
+    {
+        return invariantViolations;
+    }
+    void
+    setTickSpacingTolerance(int samples)
+    {
+        tickSpacingTolerance = samples;
+    }
+    // Optional MIDI 2.0 output. In UMP mode every event is written as a Universal MIDI
+    // Packet into a preallocated word buffer, preceded by a JR timestamp that holds its
+    // exact sample time, so interfaces that honour them aren't bound to block delivery.
+    // The buffer is refilled on each generateMidiclock() call.
+    enum OutputFormat
+    {
+        midi1Output = 0,
+        umpOutput,
+        midi1AndUmpOutput
+    };
+    void
+    setOutputFormat(OutputFormat format)
+    {
+        outputFormat = format;
+    }
+    OutputFormat
+    getOutputFormat()
+    {
+        return outputFormat;
+    }
+    void
+    setUmpGroup(int group)
+    {
+        const uint32 groupBits = static_cast<uint32>(group & 0x0f) << 24;
+
+        umpSystemHeader = 0x10000000 | groupBits;
+        umpSysExHeader  = 0x30000000 | groupBits;
+        umpClockPacket  = umpSystemHeader | 0x00f80000;
+    }
+    const uint32*
+    getUmpData()
+    {
+        return umpWords;
+    }
+    int
+    getNumUmpWords()
+    {
+        return numUmpWords;
+    }
 
      void generateMidiclock(const AudioPlayHead::PositionInfo& positionInfo, MidiBuffer* midiBuffer, int bufferSize, double sampleRate);
 
@@ -63,7 +192,7 @@ class JK_MidiClock
     double posChangeThreshold = 0.001;
     double ppqToStartSyncAt   = 0.0;
     bool   followSongPosition = true;
-    uint8_t  syncFlag           = 0;
+    uint8_t  syncFlag           = gStartSlave;  // The slave starts out stopped
     int    ppqOffset          = 0;
 
     static const int gCycleEnd   = 1;
@@ -73,7 +202,124 @@ class JK_MidiClock
     MidiMessage continueMessage{MidiMessage::midiContinue()};
     MidiMessage stopMessage{MidiMessage::midiStop()};
 
-    void sendSongPositionPointerMessage(double ppqPosition, int posInBuffer, MidiBuffer* buffer);
+    // Look-ahead scheduling. Events are predicted for a window running lookAhead ahead of
+    // the current block and parked in a fixed ring until they are due.
+    static constexpr double maxLookAheadMs  = 500.0;
+    static const int        pendingCapacity = 512;
+
+    struct PendingEvent
+    {
+        int64   dueSample   = 0;    // Output sample the event is emitted at
+        double  ppqPosition = 0.0;  // Position it was predicted for, used for retiming
+        uint8   data[16]{};  // Fits an MMC locate
+        int     numBytes = 0;
+    };
+
+    double       lookAheadMs               = 0.0;
+    int          lookAheadSamples          = 0;
+    PendingEvent pendingEvents[pendingCapacity];
+    int          pendingRead               = 0;
+    int          pendingCount              = 0;
+    int64        blockStartSample          = 0;
+    int64        windowStartSample         = 0;
+    double       windowStartPpq            = 0.0;
+    double       windowPpqPerSample        = 0.0;
+    double       predictedUntilPpq         = 0.0;
+    double       predictedBpm              = 0.0;
+    int          predictedLookAheadSamples = 0;
+    MidiBuffer*  outputBuffer              = nullptr;
+    bool         schedulingAhead           = false;
+    bool         slaveIsRunning            = false;  // As sent, not as predicted
+
+    void renderWindow(const AudioPlayHead::PositionInfo& positionInfo, double hostPpqPosition, int numSamples, double sampleRate, double bpm);
+    void scheduleAhead(const AudioPlayHead::PositionInfo& positionInfo, double hostPpqPosition, int bufferSize, double sampleRate, double bpm);
+    void addEvent(const MidiMessage& message, int posInWindow);
+    void addEvent(const uint8* data, int numBytes, int posInWindow);
+    void retimePendingEvents(double hostPpqPosition, double ppqPerSample);
+    void cancelPendingEvents();
+
+    void sendSongPositionPointerMessage(double ppqPosition, int posInWindow);
+
+    InvariantViolations invariantViolations;
+    int                 tickSpacingTolerance     = 2;
+    int                 expectedTickSpacing      = 0;
+    int                 expectedLookAheadSamples = 0;
+    double              expectedTickBpm          = 0.0;
+    int64               lastTickSample           = -1;
+    int64               steadyFromSample         = 0;
+
+    void emitEvent(const uint8* data, int numBytes, int posInBuffer);
+#if JK_MIDICLOCK_CHECK_INVARIANTS
+    void checkInvariants(const uint8* data, int64 samplePosition);
+#endif
+
+    // UMP output. System messages are a single 32-bit packet (type 0x1), SysEx goes
+    // out as 64-bit SysEx7 packets (type 0x3) and JR clock/timestamps are utility
+    // packets (type 0x0) counting 1/31250 s of our sample clock.
+    static const int    umpCapacity     = 8192;
+    static const uint32 umpJrClock      = 0x00100000;
+    static const uint32 umpJrTimestamp  = 0x00200000;
+    static constexpr double jrTicksPerSecond = 31250.0;
+
+    OutputFormat outputFormat         = midi1Output;
+    uint32       umpSystemHeader      = 0x10000000;  // Type and group, pre-encoded
+    uint32       umpSysExHeader       = 0x30000000;
+    uint32       umpClockPacket       = 0x10f80000;
+    uint32       umpWords[umpCapacity]{};
+    int          numUmpWords          = 0;
+    double       umpSampleRate        = 44100.0;
+
+    void writeUmp(const uint8* data, int numBytes, int64 samplePosition);
+    void writeUmpWords(const uint32* words, int count);
+    uint32 getJrTime(int64 samplePosition);
+
+    // MMC, built from pre-encoded SysEx that is patched in place
+    static const int   maxMmcDeviceIds = 8;
+    static const uint8 mmcStop         = 0x01;
+    static const uint8 mmcPlay         = 0x02;
+
+    bool   mmcEnabled                    = false;
+    uint8  mmcDeviceIds[maxMmcDeviceIds] = {0x7f};
+    int    numMmcDeviceIds               = 1;
+    uint8  mmcCommandTemplate[6]         = {0xf0, 0x7f, 0x7f, 0x06, 0x00, 0xf7};
+    uint8  mmcLocateTemplate[13]         = {0xf0, 0x7f, 0x7f, 0x06, 0x44, 0x06, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0xf7};
+    double timecodeAnchorPpq             = 0.0;
+    double timecodeAnchorSeconds         = 0.0;
+    double timecodeSecondsPerPpq         = 0.5;
+
+    AudioPlayHead::FrameRate timecodeFrameRate;
+
+    void sendMmcCommand(uint8 command, int posInWindow);
+    void sendMmcLocate(double ppqPosition, int posInWindow);
+
+    // Transport estimate the state machine runs on, see updateTransportEstimate()
+    static constexpr double estimatorAlpha      = 0.25;
+    static constexpr double estimatorBeta       = 0.005;
+    static constexpr double jitterDeviations    = 4.0;  // Jitter band, in measured deviations
+    static constexpr double jitterVarianceAlpha = 0.02;
+    static constexpr int    jitterWarmUpBlocks  = 8;
+    static constexpr int    jumpConfirmBlocks   = 3;
+    static constexpr double renderAlpha         = 0.05;
+    static constexpr double renderMaxCorrection = 0.5;  // Samples per clock interval
+
+    double jitterTolerance       = 0.02;
+    double estimatedPpqPosition  = 0.0;
+    double estimatedPpqPerSample = 0.0;
+    double renderPpqPosition     = 0.0;
+    int64  lastClockIndex        = 0;
+    double estimatorPpqPerSample = 0.0;
+    double jitterVariance        = 0.0;  // Of the residuals, in seconds squared
+    double heldJitterVariance    = 0.0;
+    double heldResidualSeconds   = 0.0;
+    int    heldBlocks            = 0;
+    int    numJitterSamples      = 0;
+    int    lastBlockSize         = 0;
+    bool   estimatorIsValid      = false;
+    bool   holdingJump           = false;
+    bool   estimatorWasPlaying   = false;
+    bool   positionHasJumped     = false;
+
+    bool updateTransportEstimate(double measuredPpqPosition, bool isPlaying, int bufferSize, double sampleRate, double ppqPerSample);
 
     bool positionJumped(double lastPosInPPQ, double currentPosInPPQ, double sampleRate, double ppqPerSample);
 
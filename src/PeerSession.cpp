@@ -0,0 +1,398 @@
+#include "PeerSession.h"
+
+namespace
+{
+    // Every packet is packetFields little-endian int64s:
+    //   0 magic/version, 1 type, 2 sender node
+    //   state: 3 micro-BPM, 4 beat origin in micro-beats, 5 time origin, 6 playing,
+    //          7 change origin node, 8 change time on that node, 9 sender's ping time
+    //   pong:  3 target node, 4 echoed ping time, 5 reply time
+    constexpr juce::int64 packetMagic = 0x4a4b505300000001; // "JKPS" v1
+
+    juce::int64 toMicroUnits (double value)     { return (juce::int64) std::llround (value * 1.0e6); }
+    double fromMicroUnits (juce::int64 value)   { return (double) value / 1.0e6; }
+}
+
+//==============================================================================
+PeerSession::PeerSession()
+    : juce::Thread ("Peer Session"),
+      nodeId ((juce::Random::getSystemRandom().nextInt64() & 0x7fffffffffffffff) | 1)
+{
+}
+
+PeerSession::~PeerSession()
+{
+    stop();
+}
+
+//==============================================================================
+bool PeerSession::start (const juce::String& groupAddress, int port, bool loopback)
+{
+    stop();
+
+    socket = std::make_unique<juce::DatagramSocket>();
+    group = groupAddress;
+    basePort = port;
+    loopbackMode = loopback;
+
+    bool bound = false;
+
+    if (loopbackMode)
+    {
+        // First free port of the range, peers send to all the others
+        for (int i = 0; i < maxLoopbackPeers && ! bound; ++i)
+            bound = socket->bindToPort (basePort + i, "127.0.0.1");
+    }
+    else
+    {
+        // Port reuse and multicast loopback let several instances share one machine
+        socket->setEnablePortReuse (true);
+        bound = socket->bindToPort (basePort) && socket->joinMulticast (group);
+        socket->setMulticastLoopbackEnabled (true);
+    }
+
+    if (! bound)
+    {
+        socket.reset();
+        return false;
+    }
+
+    // Whatever was published before starting is our timeline, but it doesn't count
+    // as a change, so we join an existing session rather than resetting it.
+    const auto change = localChange.read();
+
+    ownTimeline = change.timeline;
+    ownIsPlaying = change.isPlaying;
+    ownChangeOrigin = nodeId;
+    ownChangeOriginMicros = 0;
+    ownChangeLocalMicros = std::numeric_limits<juce::int64>::min();
+    lastLocalChangeVersion = localChange.getVersion();
+    numPeers = 0;
+    phaseError.store (0.0);
+
+    running.store (true);
+    startThread();
+
+    return true;
+}
+
+void PeerSession::stop()
+{
+    running.store (false);
+    stopThread (1000);
+
+    if (socket != nullptr)
+    {
+        socket->shutdown();
+        socket.reset();
+    }
+
+    sessionSnapshot.write ({});
+}
+
+//==============================================================================
+void PeerSession::publishTimeline (double bpm, double beat, bool isPlaying, juce::int64 atMicros) noexcept
+{
+    LocalChange change;
+    change.timeline.bpm = bpm;
+    change.timeline.beatOrigin = beat;
+    change.timeline.timeOriginMicros = atMicros;
+    change.isPlaying = isPlaying;
+
+    localChange.write (change);
+}
+
+void PeerSession::seedTimeline (double bpm, double beat, bool isPlaying, juce::int64 atMicros) noexcept
+{
+    LocalChange change;
+    change.timeline.bpm = bpm;
+    change.timeline.beatOrigin = beat;
+    change.timeline.timeOriginMicros = atMicros;
+    change.isPlaying = isPlaying;
+    change.isChange = false;
+
+    localChange.write (change);
+}
+
+PeerSession::Snapshot PeerSession::getSnapshot() const noexcept
+{
+    sessionSnapshot.tryRead (lastSnapshot);
+    return lastSnapshot;
+}
+
+juce::int64 PeerSession::getNowMicros() const noexcept
+{
+    return (juce::int64) (juce::Time::getMillisecondCounterHiRes() * 1000.0) + simulatedClockOffset.load();
+}
+
+//==============================================================================
+void PeerSession::run()
+{
+    char buffer[packetFields * sizeof (juce::int64) + 16];
+    juce::String senderAddress;
+    int senderPort = 0;
+    juce::int64 nextBroadcastMicros = 0;
+
+    while (! threadShouldExit())
+    {
+        takeLocalChange();
+
+        if (getNowMicros() >= nextBroadcastMicros)
+        {
+            sendState (getNowMicros());
+            nextBroadcastMicros = getNowMicros() + broadcastIntervalMicros;
+        }
+
+        // Short timeout so local changes go out promptly
+        if (socket->waitUntilReady (true, 5) == 1)
+        {
+            do
+            {
+                const auto numBytes = socket->read (buffer, (int) sizeof (buffer), false, senderAddress, senderPort);
+
+                if (numBytes <= 0)
+                    break;
+
+                handlePacket (buffer, numBytes, getNowMicros());
+            }
+            while (socket->waitUntilReady (true, 0) == 1);
+        }
+
+        updateSession (getNowMicros());
+    }
+}
+
+void PeerSession::takeLocalChange()
+{
+    const auto version = localChange.getVersion();
+
+    if (version == lastLocalChangeVersion)
+        return;
+
+    const auto change = localChange.read();
+    lastLocalChangeVersion = version;
+
+    if (! change.isChange)
+    {
+        // A seed is dropped once we made or adopted a change, and waits for the heartbeat
+        if (ownChangeOriginMicros == 0)
+        {
+            ownTimeline = change.timeline;
+            ownIsPlaying = change.isPlaying;
+        }
+
+        return;
+    }
+
+    ownTimeline = change.timeline;
+    ownIsPlaying = change.isPlaying;
+    ownChangeOrigin = nodeId;
+    ownChangeOriginMicros = change.timeline.timeOriginMicros;
+    ownChangeLocalMicros = change.timeline.timeOriginMicros;
+
+    // Let the others know straight away rather than on the next heartbeat
+    sendState (getNowMicros());
+}
+
+//==============================================================================
+void PeerSession::sendState (juce::int64 now)
+{
+    const juce::int64 fields[packetFields] = { packetMagic,
+                                               statePacket,
+                                               nodeId,
+                                               toMicroUnits (ownTimeline.bpm),
+                                               toMicroUnits (ownTimeline.beatOrigin),
+                                               ownTimeline.timeOriginMicros,
+                                               ownIsPlaying ? 1 : 0,
+                                               ownChangeOrigin,
+                                               ownChangeOriginMicros,
+                                               now };
+    sendPacket (fields);
+}
+
+void PeerSession::sendPong (juce::int64 targetNodeId, juce::int64 echoedMicros, juce::int64 now)
+{
+    const juce::int64 fields[packetFields] = { packetMagic, pongPacket, nodeId, targetNodeId, echoedMicros, now };
+    sendPacket (fields);
+}
+
+void PeerSession::sendPacket (const juce::int64* fields)
+{
+    char buffer[packetFields * sizeof (juce::int64)];
+
+    for (int i = 0; i < packetFields; ++i)
+    {
+        const auto littleEndian = juce::ByteOrder::swapIfBigEndian ((juce::uint64) fields[i]);
+        memcpy (buffer + (size_t) i * sizeof (juce::int64), &littleEndian, sizeof (littleEndian));
+    }
+
+    if (loopbackMode)
+    {
+        for (int i = 0; i < maxLoopbackPeers; ++i)
+            if (basePort + i != socket->getBoundPort())
+                socket->write ("127.0.0.1", basePort + i, buffer, (int) sizeof (buffer));
+    }
+    else
+    {
+        socket->write (group, basePort, buffer, (int) sizeof (buffer));
+    }
+}
+
+void PeerSession::handlePacket (const void* data, int numBytes, juce::int64 now)
+{
+    if (numBytes < (int) (packetFields * sizeof (juce::int64)))
+        return;
+
+    juce::int64 fields[packetFields];
+
+    for (int i = 0; i < packetFields; ++i)
+        fields[i] = (juce::int64) juce::ByteOrder::littleEndianInt64 (static_cast<const char*> (data) + (size_t) i * sizeof (juce::int64));
+
+    // Multicast loopback hands us our own packets too
+    if (fields[0] != packetMagic || fields[2] == nodeId)
+        return;
+
+    if (fields[1] == statePacket)
+    {
+        auto* peer = findOrAddPeer (fields[2]);
+
+        if (peer == nullptr)
+            return;
+
+        peer->lastSeenMicros = now;
+        peer->timeline.bpm = fromMicroUnits (fields[3]);
+        peer->timeline.beatOrigin = fromMicroUnits (fields[4]);
+        peer->timeline.timeOriginMicros = fields[5];
+        peer->isPlaying = fields[6] != 0;
+        peer->changeOrigin = fields[7];
+        peer->changeOriginMicros = fields[8];
+
+        sendPong (peer->nodeId, fields[9], getNowMicros());
+    }
+    else if (fields[1] == pongPacket && fields[3] == nodeId)
+    {
+        auto* peer = findPeer (fields[2]);
+
+        if (peer == nullptr)
+            return;
+
+        // NTP style: the reply was sent half way through the round trip
+        const auto roundTrip = now - fields[4];
+        const auto offset = fields[5] - (fields[4] + now) / 2;
+
+        peer->roundTrips[peer->nextOffset] = roundTrip;
+        peer->offsets[peer->nextOffset] = offset;
+        peer->nextOffset = (peer->nextOffset + 1) % Peer::numOffsetSamples;
+        peer->numOffsets = juce::jmin (peer->numOffsets + 1, Peer::numOffsetSamples);
+
+        int best = 0;
+
+        for (int i = 1; i < peer->numOffsets; ++i)
+            if (peer->roundTrips[i] < peer->roundTrips[best])
+                best = i;
+
+        peer->offsetMicros = peer->offsets[best];
+    }
+}
+
+PeerSession::Peer* PeerSession::findPeer (juce::int64 id) noexcept
+{
+    for (int i = 0; i < numPeers; ++i)
+        if (peers[i].nodeId == id)
+            return &peers[i];
+
+    return nullptr;
+}
+
+PeerSession::Peer* PeerSession::findOrAddPeer (juce::int64 id)
+{
+    if (auto* peer = findPeer (id))
+        return peer;
+
+    if (numPeers == maxPeers)
+        return nullptr;
+
+    peers[numPeers] = {};
+    peers[numPeers].nodeId = id;
+
+    return &peers[numPeers++];
+}
+
+bool PeerSession::toLocalTime (juce::int64 node, juce::int64 micros, juce::int64& localMicros) noexcept
+{
+    if (node == nodeId)
+    {
+        localMicros = micros;
+        return true;
+    }
+
+    if (auto* peer = findPeer (node))
+    {
+        if (peer->numOffsets > 0)
+        {
+            localMicros = micros - peer->offsetMicros;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+//==============================================================================
+void PeerSession::updateSession (juce::int64 now)
+{
+    for (int i = numPeers; --i >= 0;)
+        if (now - peers[i].lastSeenMicros > peerTimeoutMicros)
+            peers[i] = peers[--numPeers];
+
+    // Adopt the most recent change known to any peer we can measure time against
+    int numSyncedPeers = 0;
+    double maxPhaseError = 0.0;
+
+    for (int i = 0; i < numPeers; ++i)
+    {
+        auto& peer = peers[i];
+
+        if (peer.numOffsets == 0)
+            continue;
+
+        ++numSyncedPeers;
+
+        const bool sameChange = peer.changeOrigin == ownChangeOrigin && peer.changeOriginMicros == ownChangeOriginMicros;
+        juce::int64 changeLocalMicros = 0;
+
+        if (! sameChange && peer.changeOriginMicros != 0
+            && toLocalTime (peer.changeOrigin, peer.changeOriginMicros, changeLocalMicros)
+            && (changeLocalMicros > ownChangeLocalMicros
+                || (changeLocalMicros == ownChangeLocalMicros && peer.changeOrigin > ownChangeOrigin)))
+        {
+            ownTimeline = peer.timeline;
+            ownTimeline.timeOriginMicros -= peer.offsetMicros;
+            ownIsPlaying = peer.isPlaying;
+            ownChangeOrigin = peer.changeOrigin;
+            ownChangeOriginMicros = peer.changeOriginMicros;
+            ownChangeLocalMicros = changeLocalMicros;
+        }
+    }
+
+    for (int i = 0; i < numPeers; ++i)
+    {
+        const auto& peer = peers[i];
+
+        if (peer.numOffsets > 0)
+        {
+            const auto peerBeat = peer.timeline.beatAt (now + peer.offsetMicros);
+            maxPhaseError = juce::jmax (maxPhaseError, std::abs (peerBeat - ownTimeline.beatAt (now)));
+        }
+    }
+
+    phaseError.store (maxPhaseError);
+
+    Snapshot snapshot;
+    snapshot.timeline = ownTimeline;
+    snapshot.isPlaying = ownIsPlaying;
+    snapshot.numPeers = numSyncedPeers;
+    snapshot.valid = true;
+
+    sessionSnapshot.write (snapshot);
+}
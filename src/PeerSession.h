@@ -0,0 +1,202 @@
+#pragma once
+
+#include <juce_core/juce_core.h>
+
+//==============================================================================
+// Shares tempo, beat phase and start/stop with other instances on the network,
+// in the spirit of Ableton Link. Each peer multicasts its timeline a few times a
+// second; the most recent change anywhere in the session wins and everybody adopts
+// it. Clock offsets between machines are measured with ping/pong round trips.
+//
+// All networking happens on the session's own thread. The audio thread only
+// publishes its own changes and reads the current session through lock-free
+// snapshots.
+//
+// In loopback mode peers bind to 127.0.0.1 on a small port range and send to
+// each other directly, so several instances (or processes) can be run against
+// each other on one machine with no network configured. Giving each one a
+// simulated clock offset exercises the offset estimation, and getPhaseError()
+// reports how far apart the peers' beats are. See tests/PeerSessionLoopbackTest.cpp.
+class PeerSession  : private juce::Thread
+{
+public:
+    //==============================================================================
+    // A tempo line: beat = beatOrigin + (time - timeOrigin) * bpm / 60s
+    struct Timeline
+    {
+        double bpm = 120.0;
+        double beatOrigin = 0.0;
+        juce::int64 timeOriginMicros = 0;
+
+        double beatAt (juce::int64 micros) const noexcept
+        {
+            return beatOrigin + (double) (micros - timeOriginMicros) * bpm / 60.0e6;
+        }
+    };
+
+    // What the audio thread sees. Times are on this peer's clock, see getNowMicros().
+    struct Snapshot
+    {
+        Timeline timeline;
+        bool isPlaying = false;
+        int numPeers = 0;
+        bool valid = false;
+    };
+
+    PeerSession();
+    ~PeerSession() override;
+
+    //==============================================================================
+    // Message thread
+    bool start (const juce::String& groupAddress = "239.255.74.75", int port = 20875, bool loopback = false);
+    void stop();
+    bool isRunning() const noexcept                      { return running.load(); }
+
+    // Loopback mode only: shifts this peer's clock to simulate another machine
+    void setSimulatedClockOffset (juce::int64 micros)    { simulatedClockOffset.store (micros); }
+
+    // Largest beat difference to any peer seen on the last update, in beats. This compares
+    // timelines (tempo lines plus the clock offset estimates), not the clocks each peer
+    // actually emits, which also depend on how its audio callback lines up.
+    double getPhaseError() const noexcept                { return phaseError.load(); }
+
+    //==============================================================================
+    // Audio thread, lock- and allocation-free. getSnapshot() never waits for the network
+    // thread: if it lands on an update it returns the previous snapshot instead, so it
+    // must only be called from one thread.
+    // The beat is where this peer's timeline is at atMicros, see getNowMicros().
+    void publishTimeline (double bpm, double beat, bool isPlaying, juce::int64 atMicros) noexcept;
+    // Like publishTimeline(), but not a change: it only stands in for this peer's timeline
+    // until there is a change to follow, so joining doesn't reset a running session.
+    void seedTimeline (double bpm, double beat, bool isPlaying, juce::int64 atMicros) noexcept;
+    Snapshot getSnapshot() const noexcept;
+    juce::int64 getNowMicros() const noexcept;
+
+private:
+    //==============================================================================
+    // Single writer, any number of readers. read() retries if it overlaps a write,
+    // tryRead() gives up instead and leaves the destination alone.
+    template <typename Type>
+    class SeqLockValue
+    {
+    public:
+        void write (const Type& newValue) noexcept
+        {
+            sequence.fetch_add (1, std::memory_order_acq_rel);
+            std::atomic_thread_fence (std::memory_order_release);
+            value = newValue;
+            sequence.fetch_add (1, std::memory_order_release);
+        }
+
+        Type read() const noexcept
+        {
+            Type copy;
+
+            while (! tryRead (copy)) {}
+
+            return copy;
+        }
+
+        bool tryRead (Type& result) const noexcept
+        {
+            const auto before = sequence.load (std::memory_order_acquire);
+
+            if ((before & 1) != 0)
+                return false;
+
+            const Type copy = value;
+            std::atomic_thread_fence (std::memory_order_acquire);
+
+            if (sequence.load (std::memory_order_relaxed) != before)
+                return false;
+
+            result = copy;
+            return true;
+        }
+
+        juce::uint32 getVersion() const noexcept      { return sequence.load (std::memory_order_acquire); }
+
+    private:
+        std::atomic<juce::uint32> sequence { 0 };
+        Type value {};
+    };
+
+    struct LocalChange
+    {
+        Timeline timeline;
+        bool isPlaying = false;
+        bool isChange = true;
+    };
+
+    struct Peer
+    {
+        static constexpr int numOffsetSamples = 8;
+
+        juce::int64 nodeId = 0;
+        juce::int64 lastSeenMicros = 0;
+        Timeline timeline;                       // On the peer's clock
+        bool isPlaying = false;
+        juce::int64 changeOrigin = 0;            // Node that made the change the peer follows
+        juce::int64 changeOriginMicros = 0;      // When, on that node's clock
+
+        // Clock offset (peer minus local) from the lowest round trip of the last few pings
+        juce::int64 roundTrips[numOffsetSamples] {};
+        juce::int64 offsets[numOffsetSamples] {};
+        int numOffsets = 0;
+        int nextOffset = 0;
+        juce::int64 offsetMicros = 0;
+    };
+
+    enum PacketType
+    {
+        statePacket = 0,
+        pongPacket = 1
+    };
+
+    static constexpr int maxPeers = 16;
+    static constexpr int maxLoopbackPeers = 8;
+    static constexpr int packetFields = 10;
+    static constexpr juce::int64 broadcastIntervalMicros = 50000;
+    static constexpr juce::int64 peerTimeoutMicros = 2000000;
+
+    void run() override;
+
+    void sendState (juce::int64 now);
+    void sendPong (juce::int64 targetNodeId, juce::int64 echoedMicros, juce::int64 now);
+    void sendPacket (const juce::int64* fields);
+    void handlePacket (const void* data, int numBytes, juce::int64 now);
+    Peer* findPeer (juce::int64 id) noexcept;
+    Peer* findOrAddPeer (juce::int64 id);
+    bool toLocalTime (juce::int64 node, juce::int64 micros, juce::int64& localMicros) noexcept;
+    void takeLocalChange();
+    void updateSession (juce::int64 now);
+
+    std::unique_ptr<juce::DatagramSocket> socket;
+    juce::String group;
+    int basePort = 0;
+    bool loopbackMode = false;
+
+    const juce::int64 nodeId;
+    std::atomic<bool> running { false };
+    std::atomic<juce::int64> simulatedClockOffset { 0 };
+    std::atomic<double> phaseError { 0.0 };
+
+    // Network thread state. A change is identified by the node that made it and
+    // the time on that node's clock; ownChangeLocalMicros is that time on ours.
+    // A change time of 0 means we haven't changed anything yet and will follow
+    // whatever session we find.
+    Timeline ownTimeline;
+    bool ownIsPlaying = false;
+    juce::int64 ownChangeOrigin = 0;
+    juce::int64 ownChangeOriginMicros = 0;
+    juce::int64 ownChangeLocalMicros = 0;
+    juce::uint32 lastLocalChangeVersion = 0;
+    Peer peers[maxPeers];
+    int numPeers = 0;
+
+    SeqLockValue<LocalChange> localChange;
+    SeqLockValue<Snapshot> sessionSnapshot;
+    mutable Snapshot lastSnapshot;               // Reader side, last complete read
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (PeerSession)
+};
@@ -1,6 +1,59 @@
 #include "PluginProcessor.h"
 #include "PluginEditor.h"
-//#include "JK_MidiClock.h"
+
+// Room for a few thousand short events per block in the MIDI scratch buffers
+static constexpr size_t scratchMidiBytes = 16384;
+
+// Appends an event to the end of the buffer. This writes the same layout as
+// MidiBuffer::addEvent() (int32 time, uint16 size, data), minus its linear search for
+// the insert position, so the caller must add events in time order.
+//
+// MidiBuffer::data is documented as internal. The layout was checked against JUCE 7.0.6
+// (cmake/dependencies.cmake); check it again before moving to another major version.
+static_assert (JUCE_MAJOR_VERSION == 7, "appendEventInOrder() writes MidiBuffer's internal layout, check it against this JUCE version");
+
+static bool appendEventInOrder (juce::MidiBuffer& buffer, const juce::uint8* eventData, int numBytes, int samplePosition)
+{
+    // Same limits as MidiBuffer::addEvent(): the size is stored as a uint16
+    if (numBytes <= 0)
+        return true;
+
+    if (numBytes > (int) std::numeric_limits<juce::uint16>::max())
+        return false;
+
+    const auto offset = buffer.data.size();
+    buffer.data.insertMultiple (offset, 0, (int) (sizeof (juce::int32) + sizeof (juce::uint16)) + numBytes);
+
+    auto* d = buffer.data.begin() + offset;
+    juce::writeUnaligned<juce::int32> (d, samplePosition);
+    d += sizeof (juce::int32);
+    juce::writeUnaligned<juce::uint16> (d, (juce::uint16) numBytes);
+    d += sizeof (juce::uint16);
+    memcpy (d, eventData, (size_t) numBytes);
+
+    return true;
+}
+
+static bool appendEventInOrder (juce::MidiBuffer& buffer, const juce::MidiMessage& message, int samplePosition)
+{
+    return appendEventInOrder (buffer, message.getRawData(), message.getRawDataSize(), samplePosition);
+}
+
+// Clock and transport messages that would fight with the ones we generate
+static bool isClockOrTransportMessage (const juce::uint8* eventData)
+{
+    switch (eventData[0])
+    {
+        case 0xf2: // Song position pointer
+        case 0xf8: // Clock
+        case 0xfa: // Start
+        case 0xfb: // Continue
+        case 0xfc: // Stop
+            return true;
+        default:
+            return false;
+    }
+}
 
 //==============================================================================
 AudioPluginAudioProcessor::AudioPluginAudioProcessor()
@@ -13,6 +66,15 @@ AudioPluginAudioProcessor::AudioPluginAudioProcessor()
                      #endif
                        )
 {
+    // Exposed as a read-only output meter so the host can display the callback load.
+    addParameter (processLoadParameter = new juce::AudioParameterFloat (
+                      juce::ParameterID { "processLoad", 1 }, "Process Load",
+                      juce::NormalisableRange<float> (0.f, 1.f), 0.f,
+                      juce::AudioParameterFloatAttributes()
+                          .withCategory (juce::AudioProcessorParameter::outputMeter)
+                          .withAutomatable (false)
+                          .withLabel ("%")
+                          .withStringFromValueFunction ([] (float value, int) { return juce::String (juce::roundToInt (value * 100.f)); })));
 }
 
 AudioPluginAudioProcessor::~AudioPluginAudioProcessor()
@@ -90,7 +152,13 @@ void AudioPluginAudioProcessor::prepareToPlay (double sampleRate, int samplesPer
 {
     // Use this method as the place to do any pre-playback
     // initialisation that you need..
-    juce::ignoreUnused (sampleRate, samplesPerBlock);
+    prepared.prepare (sampleRate, samplesPerBlock);
+    generatedMidi.ensureSize (scratchMidiBytes);
+    mergedMidi.ensureSize (scratchMidiBytes);
+    framesUntilNextClock = 0.0;
+    hostTimeFilter.prepare (sampleRate);
+    loadMeasurer.reset (sampleRate, samplesPerBlock);
+    sheddingLoad.store (false);
 }
 
 void AudioPluginAudioProcessor::releaseResources()
@@ -126,7 +194,9 @@ bool AudioPluginAudioProcessor::isBusesLayoutSupported (const BusesLayout& layou
 void AudioPluginAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer,
                                               juce::MidiBuffer& midiMessages)
 {
-    juce::ignoreUnused (midiMessages);
+    // Times the whole callback against numSamples / sampleRate.
+    const juce::AudioProcessLoadMeasurer::ScopedTimer loadTimer (loadMeasurer, buffer.getNumSamples());
+    updateLoadShedding();
 
     juce::ScopedNoDenormals noDenormals;
     auto totalNumInputChannels  = getTotalNumInputChannels();
@@ -154,19 +224,163 @@ void AudioPluginAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer,
         // ..do something to the data...
     }
 
-    midiMessages.clear();
+    // Everything we generate goes to its own buffer, in time order, and is merged
+    // with (or replaces) the incoming MIDI at the end of the block.
+    generatedMidi.clear();
+
+    // Fetch the position once per block. Hosts may leave out any field (or the
+    // whole position), so fall back to the last known tempo and transport state.
+    // A block without a position must not look like a stop to the slaves.
+    const auto* playHead = getPlayHead();
+    const auto position = playHead != nullptr ? playHead->getPosition()
+                                              : juce::Optional<juce::AudioPlayHead::PositionInfo>();
+    bool hostIsPlaying = hostWasPlaying;
+
+    if (position.hasValue())
+    {
+        const auto timeSignature = position->getTimeSignature().orFallback (
+            juce::AudioPlayHead::TimeSignature { prepared.timeSigNumerator, prepared.timeSigDenominator });
+
+        prepared.update (position->getBpm().orFallback (prepared.bpm), timeSignature.numerator, timeSignature.denominator);
+        hostIsPlaying = position->getIsPlaying();
+    }
+
+    // The clock follows the host, unless a peer session overrides it below
+    bool isPlaying = hostIsPlaying;
+
+    // Share our tempo, phase and transport with any peers and run our clock on the
+    // session's tempo, phase and transport, so every machine ticks together.
+    double samplesPerClock = prepared.samplesPerClock;
+
+    // Set when following a session start: frames until the clock on the session's next beat
+    double sessionStartFrames = -1.0;
+
+    if (peerSession.isRunning())
+    {
+        // Beats have to line up where they are heard, so everything is timed at the
+        // moment the first sample of this block leaves the output. The block's time is
+        // filtered against the sample count, so callback jitter doesn't reach the clock.
+        const auto latencySamples = getLatencySamples() + outputLatencyMs.load() * prepared.sampleRate / 1000.0;
+        const auto blockOutputMicros = hostTimeFilter.getBlockTimeMicros (peerSession.getNowMicros(), buffer.getNumSamples())
+                                     + (juce::int64) (latencySamples * 1.0e6 / prepared.sampleRate);
+
+        // A locate or loop moves our phase, which is as much a change as a new tempo
+        const auto hostPpq = position.hasValue() ? position->getPpqPosition() : juce::Optional<double>();
+        const auto session = peerSession.getSnapshot();
+
+        // A host that leaves out the position is where its last one projects to. Before
+        // it has given one at all, our beat is the session's, so its phase is kept.
+        const bool hostBeatKnown = hostPpq.hasValue() || expectedHostPpqValid || session.valid;
+        const auto hostBeat = hostPpq.hasValue() ? *hostPpq
+                            : expectedHostPpqValid ? expectedHostPpq
+                                                   : session.timeline.beatAt (blockOutputMicros);
+
+        if (! sessionWasRunning)
+        {
+            // Joining: the host's state stands in until the session has a change to
+            // follow, but isn't one, so a running session isn't reset. From here on
+            // only the host's own edges are published.
+            if (hostBeatKnown)
+                peerSession.seedTimeline (prepared.bpm, hostBeat, hostIsPlaying, blockOutputMicros);
+
+            publishedBpm = prepared.bpm;
+            publishedIsPlaying = hostIsPlaying;
+            phaseChangePending = false;
+            sessionWasRunning = true;
+        }
+        else if (hostPpq.hasValue() && hostIsPlaying && hostWasPlaying && std::abs (*hostPpq - expectedHostPpq) > 1.0 / 24.0)
+        {
+            phaseChangePending = true;
+        }
+
+        // Publishing is optional work. Changes made while shedding go out once the load
+        // drops, with the position at that point.
+        if (! sheddingLoad.load() && hostBeatKnown
+            && (hostIsPlaying != publishedIsPlaying || prepared.bpm != publishedBpm || phaseChangePending))
+        {
+            peerSession.publishTimeline (prepared.bpm, hostBeat, hostIsPlaying, blockOutputMicros);
+
+            publishedBpm = prepared.bpm;
+            publishedIsPlaying = hostIsPlaying;
+            phaseChangePending = false;
+        }
+
+        if (hostPpq.hasValue() || expectedHostPpqValid)
+        {
+            expectedHostPpq = hostBeat + (hostIsPlaying ? buffer.getNumSamples() / prepared.samplesPerQuarterNote : 0.0);
+            expectedHostPpqValid = true;
+        }
+
+        if (session.valid && session.numPeers > 0)
+        {
+            // Start and stop with the session, whichever peer started or stopped it
+            isPlaying = session.isPlaying;
+
+            if (isPlaying)
+            {
+                samplesPerClock = prepared.sampleRate * 60.0 / (session.timeline.bpm * 24.0);
+
+                const auto clocks = session.timeline.beatAt (blockOutputMicros) * 24.0;
+                const auto framesToSessionClock = (1.0 - (clocks - std::floor (clocks))) * samplesPerClock;
+
+                if (! wasPlaying)
+                {
+                    // The slaves are still stopped, so the clock can jump onto the session's
+                    // grid. Their first clock is the one on the session's next beat.
+                    framesUntilNextClock = framesToSessionClock;
+
+                    const auto nextClock = (juce::int64) std::floor (clocks) + 1;
+                    sessionStartFrames = framesUntilNextClock + (double) ((24 - nextClock % 24) % 24) * samplesPerClock;
+                }
+                else
+                {
+                    // Pull the next clock towards the session's next 24th of a beat. Slewed
+                    // rather than jumped so slaves don't see an odd clock interval.
+                    auto error = framesToSessionClock - framesUntilNextClock;
+                    error -= samplesPerClock * std::round (error / samplesPerClock);
+
+                    framesUntilNextClock += error * 0.1;
+                }
+            }
+        }
+    }
+    else
+    {
+        sessionWasRunning = false;
+    }
+
+    hostWasPlaying = hostIsPlaying;
+
+    const bool useClockEngine = clockEngineEnabled.load();
+
+    if (useClockEngine != clockEngineWasEnabled)
+    {
+        // Switching clock sources: stop the slaves, and let the new source cue and
+        // start them from where the host is
+        if (wasPlaying)
+            appendEventInOrder (generatedMidi, juce::MidiMessage::midiStop(), 0);
+
+        clockEngine.resetTransport();
+        wasPlaying = false;
+        justStartedPlaying = false;
+        justStopped = false;
+        internalSequencerShouldStartOnNextClock = false;
+        eventAfterNFrames.frames = -1;
+
+        clockEngineWasEnabled = useClockEngine;
+    }
+
+    if (useClockEngine)
+    {
+        // The engine follows the host's song position, so it keeps the host's transport
+        renderClockEngine (position, hostIsPlaying, buffer.getNumSamples());
 
-    //juce::AudioPlayHead::PositionInfo posInfo;
-    //const double bpm = *posInfo.getBpm();
-    double bpm = *getPlayHead()->getPosition()->getBpm();
-    double sampleRate = 48000.0;
-    framesPerClock =  sampleRate / bpm / 0.4;
+        wasPlaying = hostIsPlaying;
+        frameCounter += buffer.getNumSamples();
 
-    //const bool isPlaying = true;//playing.load();
-    juce::AudioPlayHead::CurrentPositionInfo positionInfo;
-    bool isPlaying = getPlayHead()->getPosition()->getIsPlaying();
-    //const bool isPlaying = positionInfo.isPlaying;
-  
+        mergeIncomingMidi (midiMessages);
+        return;
+    }
 
     // We check if something happened on the main thread that prompts the internal sequencer to start
     // playing or to stop.
@@ -178,28 +392,33 @@ void AudioPluginAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer,
     if (justStartedPlaying)
     {
         justStartedPlaying = false;
-        // We enqueue a MIDI start event to be fired 1ms (44 frames) before
-        // the next MIDI clock.
-        eventAfterNFrames.frames = (int) (nextClockIsInHowManyFrames) - 48;
+        // We enqueue a MIDI start event to be fired 1ms before
+        // the next MIDI clock, or the one on the session's next beat.
+        const bool onSessionBeat = sessionStartFrames >= 0.0;
+        eventAfterNFrames.frames = (int) (onSessionBeat ? sessionStartFrames : framesUntilNextClock) - prepared.framesPerMillisecond;
 
-        if (eventAfterNFrames.frames < 0)
+        if (eventAfterNFrames.frames < 1)
         {
-            eventAfterNFrames.frames += framesPerClock;
+            eventAfterNFrames.frames += (int) (onSessionBeat ? 24.0 * samplesPerClock : samplesPerClock);
         }
-        eventAfterNFrames.f = [&midiMessages](int bufFrameOffset) {
+        eventAfterNFrames.f = [this](int bufFrameOffset) {
             const auto startMsg = juce::MidiMessage::midiStart();
-            midiMessages.addEvent(startMsg, bufFrameOffset);
+            appendEventInOrder(generatedMidi, startMsg, bufFrameOffset);
 //            printf("sending start at bufFrameOffset %d\n", bufFrameOffset);
-        };
 
-        internalSequencerShouldStartOnNextClock = true;
+            // The clock after the Start is the first one the slaves count
+            internalSequencerShouldStartOnNextClock = true;
+        };
     }
     else if (justStopped)
     {
         justStopped = false;
         const auto stopMsg = juce::MidiMessage::midiStop();
-        midiMessages.addEvent(stopMsg, 0);
+        appendEventInOrder(generatedMidi, stopMsg, 0);
 
+        // A Start still waiting for its clock must not follow the Stop
+        eventAfterNFrames.frames = -1;
+        internalSequencerShouldStartOnNextClock = false;
         playStartFrame = -1;
     }
 
@@ -215,16 +434,18 @@ void AudioPluginAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer,
             }
         }
 
-        // Clocks are sent at a constant interval of ~919 frames. Additionally,
-        // all sequencer state transitions are quantized to this interval.
-        if (floor(fmod(absoluteFramePos, framesPerClock)) == 0)
+        // Clocks are sent at a constant interval of samplesPerClock frames (~919 at
+        // 120BPM/44.1kHz). Additionally, all sequencer state transitions are quantized
+        // to this interval. The fractional remainder carries over, so no division is
+        // needed per frame.
+        if (framesUntilNextClock < 1.0)
         {
             const auto clockMsg = juce::MidiMessage::midiClock();
 
-            midiMessages.addEvent(clockMsg, i);
+            appendEventInOrder(generatedMidi, clockMsg, i);
 //            printf("Sending clock at bufFrameOffset %d\n", i);
 
-            nextClockIsInHowManyFrames = floor(framesPerClock);
+            framesUntilNextClock += samplesPerClock;
 
             if (internalSequencerShouldStartOnNextClock)
             {
@@ -233,10 +454,12 @@ void AudioPluginAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer,
             }
         }
 
-        nextClockIsInHowManyFrames--;
+        framesUntilNextClock -= 1.0;
     }
 
     frameCounter += buffer.getNumSamples();
+
+    mergeIncomingMidi (midiMessages);
     
 /*
     static int noteOn;
@@ -412,6 +635,128 @@ juce::AudioProcessor* JUCE_CALLTYPE createPluginFilter()
     return new AudioPluginAudioProcessor();
 }
 
+void AudioPluginAudioProcessor::mergeIncomingMidi (juce::MidiBuffer& midiMessages)
+{
+    // Results are copied into the host's buffer rather than swapped with it, so our
+    // scratch buffers keep the storage reserved in prepareToPlay.
+    if (! midiPassThrough.load())
+    {
+        midiMessages.clear();
+        midiMessages.data.addArray (generatedMidi.data);
+        return;
+    }
+
+    // Both buffers are already sorted, so a single merge pass keeps the result in
+    // order. On a tie incoming events go first.
+    const bool filterRealtime = filterIncomingRealtime.load();
+
+    auto incoming = midiMessages.cbegin();
+    auto generated = generatedMidi.cbegin();
+    const auto incomingEnd = midiMessages.cend();
+    const auto generatedEnd = generatedMidi.cend();
+
+    mergedMidi.clear();
+
+    while (incoming != incomingEnd || generated != generatedEnd)
+    {
+        if (generated == generatedEnd || (incoming != incomingEnd && (*incoming).samplePosition <= (*generated).samplePosition))
+        {
+            const auto event = *incoming;
+            ++incoming;
+
+            if (! (filterRealtime && isClockOrTransportMessage (event.data)))
+                appendEventInOrder (mergedMidi, event.data, event.numBytes, event.samplePosition);
+        }
+        else
+        {
+            const auto event = *generated;
+            ++generated;
+
+            appendEventInOrder (mergedMidi, event.data, event.numBytes, event.samplePosition);
+        }
+    }
+
+    midiMessages.clear();
+    midiMessages.data.addArray (mergedMidi.data);
+}
+
+void AudioPluginAudioProcessor::renderClockEngine (const juce::Optional<juce::AudioPlayHead::PositionInfo>& position,
+                                                   bool isPlaying, int numSamples)
+{
+    // The engine reads tempo, position and loop points every block. Fill in whatever the
+    // host left out, so a missing field doesn't look like a locate or a stop.
+    auto info = position.orFallback (juce::AudioPlayHead::PositionInfo());
+
+    info.setBpm (prepared.bpm);
+    info.setIsPlaying (isPlaying);
+    info.setPpqPosition (info.getPpqPosition().orFallback (clockEngineNextPpq));
+    info.setLoopPoints (info.getLoopPoints().orFallback (juce::AudioPlayHead::LoopPoints()));
+
+    clockEngine.setLookAhead (clockLookAheadMs.load());
+    clockEngine.setMmcEnabled (mmcEnabled.load());
+
+    const auto deviceIds = mmcDeviceIds.load();
+
+    if (deviceIds != appliedMmcDeviceIds)
+    {
+        clockEngine.clearMmcDeviceIds();
+
+        for (int i = 0; i < maxMmcDeviceIds && ((deviceIds >> (8 * i)) & 0xff) != 0; ++i)
+            clockEngine.addMmcDeviceId ((int) ((deviceIds >> (8 * i)) & 0xff) - 1);
+
+        if (deviceIds == 0)
+            clockEngine.addMmcDeviceId (0x7f);
+
+        appliedMmcDeviceIds = deviceIds;
+    }
+
+    clockEngine.generateMidiclock (info, &generatedMidi, numSamples, prepared.sampleRate);
+
+    clockEngineNextPpq = *info.getPpqPosition() + (isPlaying ? numSamples / prepared.samplesPerQuarterNote : 0.0);
+}
+
+void AudioPluginAudioProcessor::setMmcDeviceIds (const juce::Array<int>& deviceIds)
+{
+    juce::uint64 packed = 0;
+
+    for (int i = 0; i < juce::jmin (deviceIds.size(), maxMmcDeviceIds); ++i)
+        packed |= (juce::uint64) ((deviceIds[i] & 0x7f) + 1) << (8 * i);
+
+    mmcDeviceIds.store (packed);
+}
+
+juce::Array<int> AudioPluginAudioProcessor::getMmcDeviceIds() const
+{
+    juce::Array<int> deviceIds;
+
+    for (auto packed = mmcDeviceIds.load(); packed != 0; packed >>= 8)
+        deviceIds.add ((int) (packed & 0xff) - 1);
+
+    return deviceIds;
+}
+
+void AudioPluginAudioProcessor::updateLoadShedding()
+{
+    // Decided from the load of the previous blocks, as this one is still being timed.
+    // Clock and transport messages are never shed, only optional work checking isSheddingLoad().
+    const auto load = loadMeasurer.getLoadAsProportion();
+    const auto threshold = loadShedThreshold.load();
+
+    if (threshold <= 0.0)
+        sheddingLoad.store (false);
+    else if (load > threshold)
+        sheddingLoad.store (true);
+    else if (load < threshold * 0.75)  // Hysteresis so we don't toggle every block
+        sheddingLoad.store (false);
+
+    // Reporting to the host is itself optional work.
+    if (! sheddingLoad.load() && std::abs (load - (double) reportedProcessLoad) >= 0.01)
+    {
+        reportedProcessLoad = (float) load;
+        processLoadParameter->setValueNotifyingHost (juce::jlimit (0.f, 1.f, reportedProcessLoad));
+    }
+}
+
 void AudioPluginAudioProcessor::playStop()
 {
     playing.store(!playing.load());
@@ -1,6 +1,67 @@
 #pragma once
 
 #include <juce_audio_processors/juce_audio_processors.h>
+#include "PeerSession.h"
+#include "HostTimeFilter.h"
+#include "JK_MidiClock.h"
+
+// Sample rate and block size captured in prepareToPlay, along with the
+// tempo-derived constants the clock needs. These are only rebuilt when the
+// tempo or time signature actually changes.
+struct PreparedState {
+    double sampleRate = 44100.0;
+    int maximumBlockSize = 0;
+    int framesPerMillisecond = 44;
+
+    double bpm = 0.0;
+    int timeSigNumerator = 0;
+    int timeSigDenominator = 0;
+
+    double samplesPerQuarterNote = 0.0;
+    double samplesPerClock = 0.0; // 24 clocks per quarter note
+    double samplesPerSixteenth = 0.0;
+    double samplesPerBar = 0.0;
+
+    PreparedState() { prepare (sampleRate, maximumBlockSize); }
+
+    void prepare (double newSampleRate, int newMaximumBlockSize)
+    {
+        if (newSampleRate > 0.0)
+            sampleRate = newSampleRate;
+
+        maximumBlockSize = newMaximumBlockSize;
+        framesPerMillisecond = juce::roundToInt (sampleRate / 1000.0);
+
+        // Force the tempo constants to be rebuilt for the new rate
+        const auto previousBpm = bpm > 0.0 ? bpm : 120.0;
+        bpm = 0.0;
+        update (previousBpm, timeSigNumerator > 0 ? timeSigNumerator : 4, timeSigDenominator > 0 ? timeSigDenominator : 4);
+    }
+
+    void update (double newBpm, int numerator, int denominator)
+    {
+        // Ignore nonsense from the host and keep running on what we had
+        if (newBpm <= 0.0)
+            newBpm = bpm;
+        if (numerator <= 0 || denominator <= 0)
+        {
+            numerator = timeSigNumerator;
+            denominator = timeSigDenominator;
+        }
+
+        if (newBpm == bpm && numerator == timeSigNumerator && denominator == timeSigDenominator)
+            return;
+
+        bpm = newBpm;
+        timeSigNumerator = numerator;
+        timeSigDenominator = denominator;
+
+        samplesPerQuarterNote = sampleRate * 60.0 / bpm;
+        samplesPerClock = samplesPerQuarterNote / 24.0;
+        samplesPerSixteenth = samplesPerQuarterNote / 4.0;
+        samplesPerBar = samplesPerQuarterNote * 4.0 * numerator / denominator;
+    }
+};
 
 struct EventAfterNFrames {
     int frames = -1;
@@ -50,6 +111,49 @@ public:
     
     void playStop();
 
+    //==============================================================================
+    // Callback load watchdog. The load is an exponentially-weighted proportion of
+    // the block's real-time budget; overruns count blocks that exceeded it.
+    double getProcessLoad() const                  { return loadMeasurer.getLoadAsProportion(); }
+    int getProcessOverrunCount() const             { return loadMeasurer.getXRunCount(); }
+    bool isSheddingLoad() const                    { return sheddingLoad.load(); }
+
+    // Incoming MIDI is merged with the generated clock so the plugin can sit inline.
+    // Incoming clock/transport messages are dropped by default to avoid double clocks.
+    void setMidiPassThrough (bool shouldPassThrough)  { midiPassThrough.store (shouldPassThrough); }
+    bool getMidiPassThrough() const                   { return midiPassThrough.load(); }
+    void setFilterIncomingRealtime (bool shouldFilter) { filterIncomingRealtime.store (shouldFilter); }
+    bool getFilterIncomingRealtime() const            { return filterIncomingRealtime.load(); }
+
+    // Start/stop on the message thread to share tempo and phase over the network
+    PeerSession& getPeerSession()                     { return peerSession; }
+
+    // The audio device's output latency, which a plugin can't query. It's added to the
+    // plugin's own latency so peers line up their clocks as heard, not as rendered.
+    void setPeerOutputLatency (double ms)             { outputLatencyMs.store (ms); }
+    double getPeerOutputLatency() const               { return outputLatencyMs.load(); }
+
+    // With the clock engine on, clock follows the host's song position (song position
+    // pointers on locates and loops, look-ahead) through JK_MidiClock instead of the
+    // free running internal clock. The peer session doesn't steer it.
+    void setClockEngineEnabled (bool shouldUseEngine) { clockEngineEnabled.store (shouldUseEngine); }
+    bool getClockEngineEnabled() const                { return clockEngineEnabled.load(); }
+    void setClockLookAhead (double ms)                { clockLookAheadMs.store (ms); }
+    double getClockLookAhead() const                  { return clockLookAheadMs.load(); }
+
+    // Engine only: also send MIDI Machine Control play/stop/locate to each of up to 8
+    // device IDs. An empty list (the default) sends to all-call, 0x7F.
+    void setMmcEnabled (bool shouldSend)              { mmcEnabled.store (shouldSend); }
+    bool getMmcEnabled() const                        { return mmcEnabled.load(); }
+    void setMmcDeviceIds (const juce::Array<int>& deviceIds);
+    juce::Array<int> getMmcDeviceIds() const;
+
+    // A threshold of 0 (the default) never sheds optional work. Optional work is the
+    // load reporting and publishing to the peer session. The clock, MMC and following
+    // the session are never shed, as a device would miss a stop or a locate.
+    void setLoadShedThreshold (double proportion)  { loadShedThreshold.store (juce::jlimit (0.0, 1.0, proportion)); }
+    double getLoadShedThreshold() const            { return loadShedThreshold.load(); }
+
 private:
     //==============================================================================
 //CurrentPositionInfo positionInfo;
@@ -60,13 +164,11 @@ private:
                                            14330, 14330, 14333, 14331, 14330, 14331, 14331, 14329, 14331, 14331, 14331,
                                            14331, 14330, 14330, 14334, 14328, 1};
 
-    // 120BPM
-    double framesPerClock = 918.75;
-    const short framesPerQuarterNote = 22050;
+    PreparedState prepared;
 
     int frameCounter = 0;
     char metronomeFrameIndex = 127;
-    float nextClockIsInHowManyFrames = 0.f;
+    double framesUntilNextClock = 0.0;
 
     // Counts to 4 to provide accents
     char metronomeCounter = 3;
@@ -83,6 +185,47 @@ private:
 
     bool playheadRunning = false;
 
+    juce::AudioProcessLoadMeasurer loadMeasurer;
+    juce::AudioParameterFloat* processLoadParameter = nullptr;
+    float reportedProcessLoad = 0.f;
+    std::atomic<double> loadShedThreshold{0.0};
+    std::atomic<bool> sheddingLoad{false};
+
+    void updateLoadShedding();
+
+    juce::MidiBuffer generatedMidi;
+    juce::MidiBuffer mergedMidi;
+    std::atomic<bool> midiPassThrough{true};
+    std::atomic<bool> filterIncomingRealtime{true};
+
+    void mergeIncomingMidi (juce::MidiBuffer& midiMessages);
+
+    JK_MidiClock clockEngine;
+    std::atomic<bool> clockEngineEnabled{false};
+    bool clockEngineWasEnabled = false;
+    std::atomic<double> clockLookAheadMs{0.0};
+    std::atomic<bool> mmcEnabled{false};
+
+    // One device ID + 1 per byte, so 0 ends the list and the audio thread gets the
+    // whole list in one atomic read
+    static constexpr int maxMmcDeviceIds = 8;
+    std::atomic<juce::uint64> mmcDeviceIds{0};
+    juce::uint64 appliedMmcDeviceIds = 0;
+    double clockEngineNextPpq = 0.0;
+
+    void renderClockEngine (const juce::Optional<juce::AudioPlayHead::PositionInfo>& position, bool isPlaying, int numSamples);
+
+    PeerSession peerSession;
+    HostTimeFilter hostTimeFilter;
+    bool sessionWasRunning = false;
+    double publishedBpm = 0.0;
+    bool publishedIsPlaying = false;
+    bool hostWasPlaying = false;
+    double expectedHostPpq = 0.0;
+    bool expectedHostPpqValid = false;
+    bool phaseChangePending = false;
+    std::atomic<double> outputLatencyMs{0.0};
+
     bool   wasPlaying         = false;
     double syncPpqPosition    = -999.0;
     double posChangeThreshold = 0.001;
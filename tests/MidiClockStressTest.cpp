@@ -0,0 +1,195 @@
+// Drives JK_MidiClock with random playhead sequences, the way hosts misbehave, and
+// fails if any transport invariant is violated. It also reports the engine's
+// throughput, so it doubles as a benchmark.
+//
+// Usage: MidiClockStressTest [episodes] [seed]
+//
+// Each episode is a fresh engine at a random sample rate, tempo, look-ahead, offset
+// and block size (fixed or varying), run for blocksPerEpisode blocks with random
+// starts, stops, locates, tempo and look-ahead changes, loop toggles, host jitter and
+// single-block position spikes. A quarter as many episodes then play steadily under
+// 1-20 ms of host jitter and fail if the slave is ever restarted. Needs
+// JK_MIDICLOCK_CHECK_INVARIANTS.
+
+#include "JK_MidiClock.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <random>
+
+#if ! JK_MIDICLOCK_CHECK_INVARIANTS
+ #error "Build with JK_MIDICLOCK_CHECK_INVARIANTS=1"
+#endif
+
+namespace
+{
+    constexpr int blocksPerEpisode = 2000;
+    constexpr double sampleRates[] = { 44100.0, 48000.0, 88200.0, 96000.0, 192000.0 };
+}
+
+int main (int argc, char* argv[])
+{
+    const auto numEpisodes = argc > 1 ? std::atoll (argv[1]) : 300;
+    const auto seed = argc > 2 ? (unsigned) std::atoi (argv[2]) : 1u;
+
+    std::mt19937_64 random (seed);
+
+    auto uniform = [&] (double low, double high) { return std::uniform_real_distribution<double> (low, high) (random); };
+    auto chance = [&] (double probability) { return uniform (0.0, 1.0) < probability; };
+
+    JK_MidiClock::InvariantViolations total;
+    juce::int64 totalSamples = 0, totalBlocks = 0, totalEvents = 0;
+    std::chrono::duration<double> engineTime {};
+
+    juce::MidiBuffer midi;
+    midi.ensureSize (4096);
+
+    for (juce::int64 episode = 0; episode < numEpisodes; ++episode)
+    {
+        auto clock = std::make_unique<JK_MidiClock>();
+
+        const auto sampleRate = sampleRates[random() % std::size (sampleRates)];
+        const auto jitterMs = chance (0.5) ? 0.0 : uniform (0.0, 0.5);
+        const auto varyBlockSize = chance (0.3);
+        const auto fixedBlockSize = 32 << (random() % 7);
+
+        auto lookAheadMs = chance (0.5) ? 0.0 : uniform (0.0, 200.0);
+        clock->setLookAhead (lookAheadMs);
+        clock->setFollowSongPosition (chance (0.7));
+
+        if (chance (0.3))
+            clock->setOffset ((int) uniform (-500.0, 500.0));
+
+        const auto loopStart = std::floor (uniform (0.0, 16.0));
+
+        juce::AudioPlayHead::PositionInfo info;
+        info.setLoopPoints (juce::AudioPlayHead::LoopPoints { loopStart, loopStart + std::ceil (uniform (1.0, 8.0)) });
+
+        auto bpm = uniform (40.0, 300.0);
+        auto ppq = uniform (0.0, 32.0);
+        auto isPlaying = false;
+        auto isLooping = chance (0.5);
+
+        for (int block = 0; block < blocksPerEpisode; ++block)
+        {
+            const int numSamples = varyBlockSize ? 16 + (int) (random() % 2000) : fixedBlockSize;
+
+            if (chance (0.003))
+                isPlaying = ! isPlaying;
+            if (chance (0.002))
+                ppq = uniform (0.0, 64.0);
+            if (chance (0.002))
+                bpm = uniform (40.0, 300.0);
+            if (chance (0.001))
+                isLooping = ! isLooping;
+            if (chance (0.002))
+            {
+                // Includes switching the look-ahead on and off while playing
+                lookAheadMs = chance (0.2) ? 0.0 : uniform (0.0, 200.0);
+                clock->setLookAhead (lookAheadMs);
+            }
+
+            auto reportedPpq = ppq;
+
+            if (isPlaying && jitterMs > 0.0)
+                reportedPpq += uniform (-jitterMs, jitterMs) / 1000.0 * bpm / 60.0;
+            if (isPlaying && chance (0.0005))
+                reportedPpq += uniform (-0.02, 0.02);
+
+            info.setBpm (bpm);
+            info.setPpqPosition (reportedPpq);
+            info.setIsPlaying (isPlaying);
+            info.setIsLooping (isLooping);
+
+            midi.clear();
+
+            const auto start = std::chrono::steady_clock::now();
+            clock->generateMidiclock (info, &midi, numSamples, sampleRate);
+            engineTime += std::chrono::steady_clock::now() - start;
+
+            totalEvents += midi.getNumEvents();
+            totalSamples += numSamples;
+            ++totalBlocks;
+
+            if (isPlaying)
+            {
+                ppq += numSamples * bpm / 60.0 / sampleRate;
+
+                const auto loop = *info.getLoopPoints();
+
+                if (isLooping && ppq >= loop.ppqEnd)
+                    ppq = loop.ppqStart + (ppq - loop.ppqEnd);
+            }
+        }
+
+        const auto violations = clock->getInvariantViolations();
+
+        if (violations.doubleContinue + violations.sppWhileRunning + violations.tickSpacing > 0)
+            std::printf ("episode %lld: doubleContinue %lld, sppWhileRunning %lld, tickSpacing %lld\n",
+                         (long long) episode, (long long) violations.doubleContinue,
+                         (long long) violations.sppWhileRunning, (long long) violations.tickSpacing);
+
+        total.doubleContinue += violations.doubleContinue;
+        total.sppWhileRunning += violations.sppWhileRunning;
+        total.tickSpacing += violations.tickSpacing;
+    }
+
+    // Steady playback with 1-20 ms of host jitter, as from hosts that report the position
+    // from a jittery clock rather than the sample count. Nothing here is a jump, so the
+    // slave must never be stopped.
+    juce::int64 jitterRestarts = 0;
+
+    for (juce::int64 episode = 0; episode < numEpisodes / 4; ++episode)
+    {
+        auto clock = std::make_unique<JK_MidiClock>();
+
+        const auto sampleRate = sampleRates[random() % std::size (sampleRates)];
+        const auto jitterMs = uniform (1.0, 20.0);
+        const auto blockSize = 32 << (random() % 7);
+        const auto bpm = uniform (40.0, 300.0);
+        auto ppq = uniform (0.0, 32.0);
+
+        clock->setLookAhead (chance (0.5) ? 0.0 : uniform (0.0, 200.0));
+        clock->setFollowSongPosition (chance (0.7));
+
+        juce::AudioPlayHead::PositionInfo info;
+        info.setBpm (bpm);
+        info.setIsPlaying (true);
+
+        juce::int64 restarts = 0;
+
+        for (int block = 0; block < blocksPerEpisode; ++block)
+        {
+            info.setPpqPosition (ppq + uniform (-jitterMs, jitterMs) / 1000.0 * bpm / 60.0);
+
+            midi.clear();
+            clock->generateMidiclock (info, &midi, blockSize, sampleRate);
+
+            for (const auto metadata : midi)
+                if (metadata.data[0] == 0xfc)
+                    ++restarts;
+
+            ppq += blockSize * bpm / 60.0 / sampleRate;
+        }
+
+        if (restarts > 0)
+            std::printf ("jitter episode %lld: %lld restarts at %.1f ms jitter, %d samples per block\n",
+                         (long long) episode, (long long) restarts, jitterMs, blockSize);
+
+        jitterRestarts += restarts;
+    }
+
+    std::printf ("%lld blocks, %.1f h of audio, %lld events in %.2f s: %.1f Msamples/s, %.2f us/block\n",
+                 (long long) totalBlocks, (double) totalSamples / 48000.0 / 3600.0, (long long) totalEvents,
+                 engineTime.count(), (double) totalSamples / engineTime.count() / 1.0e6,
+                 engineTime.count() / (double) totalBlocks * 1.0e6);
+
+    std::printf ("violations: doubleContinue %lld, sppWhileRunning %lld, tickSpacing %lld\n",
+                 (long long) total.doubleContinue, (long long) total.sppWhileRunning, (long long) total.tickSpacing);
+
+    std::printf ("restarts under 1-20 ms jitter: %lld\n", (long long) jitterRestarts);
+
+    return total.doubleContinue + total.sppWhileRunning + total.tickSpacing + jitterRestarts == 0 ? 0 : 1;
+}
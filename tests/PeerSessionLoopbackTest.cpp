@@ -0,0 +1,138 @@
+// Runs several PeerSession instances against each other over loopback, each with
+// its own simulated clock offset, and checks that they agree on one session.
+//
+// Usage: PeerSessionLoopbackTest [basePort]
+//
+// This checks the shared timelines only, i.e. tempo, transport and the clock
+// offset estimates. Where each plugin actually puts its clocks also depends on
+// its audio callback and is not covered here.
+
+#include "PeerSession.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+
+namespace
+{
+    constexpr int numPeers = 4;
+    constexpr double beatTolerance = 0.01;   // 4.5ms at 133 BPM
+    constexpr int timeoutMs = 3000;
+
+    int numFailures = 0;
+
+    void check (bool condition, const char* what)
+    {
+        std::printf ("%s: %s\n", condition ? "PASS" : "FAIL", what);
+
+        if (! condition)
+            ++numFailures;
+    }
+
+    bool waitFor (const std::function<bool()>& condition)
+    {
+        for (int elapsed = 0; elapsed < timeoutMs; elapsed += 10)
+        {
+            if (condition())
+                return true;
+
+            juce::Thread::sleep (10);
+        }
+
+        return condition();
+    }
+}
+
+int main (int argc, char* argv[])
+{
+    const int basePort = argc > 1 ? std::atoi (argv[1]) : 31000;
+
+    std::unique_ptr<PeerSession> peers[numPeers];
+
+    auto allPeers = [&] (const std::function<bool (PeerSession&)>& condition)
+    {
+        for (auto& peer : peers)
+            if (peer != nullptr && ! condition (*peer))
+                return false;
+
+        return true;
+    };
+
+    for (int i = 0; i < numPeers; ++i)
+    {
+        peers[i] = std::make_unique<PeerSession>();
+
+        // Minutes apart, as if on different machines
+        peers[i]->setSimulatedClockOffset ((juce::int64) i * 123456789);
+        peers[i]->publishTimeline (100.0 + i, 0.0, false, peers[i]->getNowMicros());
+
+        if (! peers[i]->start ({}, basePort, true))
+        {
+            std::printf ("FAIL: peer %d can't bind to the loopback ports from %d\n", i, basePort);
+            return 1;
+        }
+    }
+
+    check (waitFor ([&] { return allPeers ([] (PeerSession& p) { return p.getSnapshot().numPeers == numPeers - 1; }); }),
+           "every peer finds the others");
+
+    // A change on one peer is adopted everywhere, on each peer's own clock
+    peers[2]->publishTimeline (133.0, 8.0, true, peers[2]->getNowMicros());
+
+    check (waitFor ([&] { return allPeers ([] (PeerSession& p)
+                                           {
+                                               const auto s = p.getSnapshot();
+                                               return s.timeline.bpm == 133.0 && s.isPlaying;
+                                           }); }),
+           "tempo and start propagate");
+
+    const auto referenceBeat = [&] { return peers[2]->getSnapshot().timeline.beatAt (peers[2]->getNowMicros()); };
+
+    for (int i = 0; i < numPeers; ++i)
+    {
+        const auto before = referenceBeat();
+        const auto beat = peers[i]->getSnapshot().timeline.beatAt (peers[i]->getNowMicros());
+        const auto after = referenceBeat();
+
+        std::printf ("peer %d beat %.4f, reference %.4f\n", i, beat, (before + after) / 2.0);
+        check (std::abs (beat - (before + after) / 2.0) < beatTolerance + (after - before), "beats agree");
+    }
+
+    // Peers rebroadcast an adopted change on their next heartbeat
+    check (waitFor ([&] { return allPeers ([] (PeerSession& p) { return p.getPhaseError() < beatTolerance; }); }),
+           "timelines agree");
+
+    for (int i = 0; i < numPeers; ++i)
+        std::printf ("peer %d phase error %.5f beats\n", i, peers[i]->getPhaseError());
+
+    // Any peer can stop the session
+    peers[0]->publishTimeline (133.0, 20.0, false, peers[0]->getNowMicros());
+
+    check (waitFor ([&] { return allPeers ([] (PeerSession& p) { return ! p.getSnapshot().isPlaying; }); }),
+           "stop propagates");
+
+    // Seeding, as a plugin does when its host joins a running session, doesn't take it over
+    peers[3]->seedTimeline (90.0, 0.0, true, peers[3]->getNowMicros());
+    juce::Thread::sleep (300);
+
+    check (allPeers ([] (PeerSession& p)
+                     {
+                         const auto s = p.getSnapshot();
+                         return s.timeline.bpm == 133.0 && ! s.isPlaying;
+                     }),
+           "a seed doesn't change the session");
+
+    // A peer that goes away is dropped after the timeout
+    peers[1]->stop();
+    peers[1].reset();
+
+    check (waitFor ([&] { return allPeers ([] (PeerSession& p) { return p.getSnapshot().numPeers == numPeers - 2; }); }),
+           "a departed peer is dropped");
+
+    for (auto& peer : peers)
+        if (peer != nullptr)
+            peer->stop();
+
+    std::printf ("%d failure(s)\n", numFailures);
+    return numFailures == 0 ? 0 : 1;
+}